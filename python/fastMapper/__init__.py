@@ -1,4 +1,4 @@
 # from .fastMapper import fastMapper
-from .fastMapper import fastMapper
+from .fastMapper import fastMapper, Model, Future
 
 
@@ -1,5 +1,26 @@
+import asyncio
+import concurrent.futures
+import os
+
 import fastMapper_pybind as fp_pybind
 
+
+class Future(concurrent.futures.Future):
+    # 后台生成的结果  由 C++ 线程池中的线程完成
+    # 开始前 cancel() 与普通的 Future 相同  开始后 cancel() 与普通的 Future 一样返回 False 但会通知生成在下一次观察前结束
+    # 生成因此提前结束时 result() 抛出 CancelledError  取消来得太晚 生成已经完成时仍然返回结果
+
+    def __init__(self):
+        super().__init__()
+        self._token = fp_pybind.CancelToken()
+
+    def cancel(self):
+        if super().cancel():
+            return True
+        if not self.done():
+            self._token.cancel()
+        return False
+
 class fastMapper:
     # single_run(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type);
 
@@ -12,7 +33,17 @@ class fastMapper:
                  log=1,
                  input_data="null",
                  output_data="null",
-                 type="null"):
+                 type="null",
+                 noise=0,
+                 threads=0,
+                 backtrack=0,
+                 max_attempts=1,
+                 seed=0,
+                 propagation="ac4",
+                 tile=0,
+                 tile_overlap=2,
+                 propagation_threads=1,
+                 race=1):
         self.out_height = out_height
         self.out_width = out_width
         self.symmetry = symmetry
@@ -22,12 +53,114 @@ class fastMapper:
         self.input_data = input_data
         self.output_data = output_data
         self.type = type
+        self.noise = noise
+        self.threads = threads
+        self.backtrack = backtrack
+        self.max_attempts = max_attempts
+        self.seed = seed
+        self.propagation = propagation
+        self.tile = tile
+        self.tile_overlap = tile_overlap
+        self.propagation_threads = propagation_threads
+        self.race = race
         print("init succes ....")
 
     # single_run(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type);
+    # 返回 dict: success seed attempts contradictions backtracks  用返回的 seed 可以复现成功的结果
 
     def run(self):
-        fp_pybind.run(self.out_height, self.out_width, self.symmetry, self.N, self.channels, self.log,self.input_data, self.output_data, self.type)
+        return fp_pybind.run(self.out_height, self.out_width, self.symmetry, self.N, self.channels, self.log,self.input_data, self.output_data, self.type, self.noise, self.threads, self.backtrack, self.max_attempts, self.seed, self.propagation, self.tile, self.tile_overlap, self.propagation_threads, self.race)
+
+    # 输入为 uint8 的 (height, width[, channels]) 数组 忽略 input_data 和 output_data
+    # 返回 (image, result)  image 为 (out_height, out_width, 3) 的 uint8 数组 直接使用生成结果的内存
+    def run_array(self, image):
+        return fp_pybind.run_array(image, self.out_height, self.out_width, self.symmetry, self.N, self.noise,
+                                   self.threads, self.backtrack, self.max_attempts, self.seed, self.propagation,
+                                   self.tile, self.tile_overlap, self.propagation_threads, self.race, self.log)
+
+    # 在后台线程池中执行 run  立即返回 Future  结果为 dict: success seed attempts contradictions backtracks
+    def run_async(self):
+        future = Future()
+        fp_pybind.run_async(future, future._token, self.out_height, self.out_width, self.symmetry, self.N,
+                            self.channels, self.log, self.input_data, self.output_data, self.type, self.noise,
+                            self.threads, self.backtrack, self.max_attempts, self.seed, self.propagation,
+                            self.tile, self.tile_overlap, self.propagation_threads, self.race)
+        return future
+
+    # asyncio 中使用  await module.arun()
+    async def arun(self):
+        return await asyncio.wrap_future(self.run_async())
+
+
+class Model:
+    # 从输入构建一次规则集  之后可以生成任意数量 任意尺寸的结果
+
+    def __init__(self, input_data, N=2, symmetry=8, channels=3, threads=0, type="img", log=0):
+        self._model = fp_pybind.Model(input_data, N, symmetry, channels, threads, type, log)
+
+    # 从 save() 写出的文件加载  不需要原始输入  来源不可信的文件用 verify=True 检查全部内容
+    @classmethod
+    def load(cls, path, verify=False):
+        model = cls.__new__(cls)
+        model._model = fp_pybind.Model.load(path, verify)
+        return model
+
+    # 从 uint8 的 (height, width[, channels]) 数组构建
+    @classmethod
+    def from_array(cls, image, N=2, symmetry=8, threads=0, log=0):
+        model = cls.__new__(cls)
+        model._model = fp_pybind.Model.from_array(image, N, symmetry, threads, log)
+        return model
+
+    def save(self, path):
+        self._model.save(path)
+
+    @property
+    def feature_size(self):
+        return self._model.feature_size
+
+    # 返回 dict: success seed attempts contradictions backtracks  用返回的 seed 可以复现成功的结果
+    def generate(self, out_height, out_width, output_data, noise=0, log=0, backtrack=0, max_attempts=1, seed=0,
+                 propagation="ac4", tile=0, tile_overlap=2, propagation_threads=1,
+                 race=1):
+        return self._model.generate(out_height, out_width, output_data, noise, log, backtrack, max_attempts, seed,
+                                    propagation, tile, tile_overlap, propagation_threads, race)
+
+    # 不写文件 返回 (image, result)  image 为 (out_height, out_width, 3) 的 uint8 数组 直接使用生成结果的内存
+    def generate_array(self, out_height, out_width, noise=0, log=0, backtrack=0, max_attempts=1, seed=0,
+                       propagation="ac4", tile=0, tile_overlap=2, propagation_threads=1, race=1):
+        return self._model.generate_array(out_height, out_width, noise, log, backtrack, max_attempts, seed,
+                                          propagation, tile, tile_overlap, propagation_threads, race)
+
+    # 在后台线程池中生成 立即返回 Future  return_image 为 True 时结果为 (image, result) 否则为 result
+    # 生成期间不持有 GIL  同一个规则集可以同时提交多个
+    def generate_async(self, out_height, out_width, output_data="", return_image=True, noise=0, log=0, backtrack=0,
+                       max_attempts=1, seed=0, propagation="ac4", tile=0, tile_overlap=2, propagation_threads=1,
+                       race=1):
+        future = Future()
+        self._model.generate_async(future, future._token, out_height, out_width, output_data, return_image, noise,
+                                   log, backtrack, max_attempts, seed, propagation, tile, tile_overlap,
+                                   propagation_threads, race)
+        return future
+
+    # asyncio 中使用  取消 await 的任务时同时取消后台的生成
+    async def agenerate(self, out_height, out_width, output_data="", return_image=True, noise=0, log=0, backtrack=0,
+                        max_attempts=1, seed=0, propagation="ac4", tile=0, tile_overlap=2, propagation_threads=1,
+                        race=1):
+        return await asyncio.wrap_future(self.generate_async(out_height, out_width, output_data, return_image, noise,
+                                                             log, backtrack, max_attempts, seed, propagation, tile,
+                                                             tile_overlap, propagation_threads, race))
+
+    # 一次生成多张图  共用规则集 在 threads 个线程中并行  seeds 为空时由 seed 派生 count 个种子
+    # output_dir 不为空时第 i 张写入 output_dir/i.png  return_images 为 True 时每项的 "image" 为 RGB 字节 (height * width * 3)
+    def generate_batch(self, out_height, out_width, count=0, seeds=None, output_dir="", return_images=True,
+                       threads=0, noise=0, log=0, backtrack=0, max_attempts=1, seed=0, propagation="ac4",
+                       propagation_threads=1):
+        if output_dir:
+            os.makedirs(output_dir, exist_ok=True)
+        return self._model.generate_batch(out_height, out_width, count, list(seeds or []), output_dir,
+                                          return_images, threads, noise, log, backtrack, max_attempts, seed,
+                                          propagation, propagation_threads)
 
 
 if __name__ == "__main__":
@@ -0,0 +1,35 @@
+#!/bin/sh
+# 检查 ac4 传播的线程数只影响速度: 1 个和多个线程对同一个种子生成的图像必须完全相同
+# 用法: sh check_threads.sh [线程数...]   默认比较 1 2 4 8
+
+cd "$(dirname "$0")/.."
+mkdir -p build
+mkdir -p output
+cd build
+cmake .. > /dev/null
+make > /dev/null || exit 1
+
+cd ../output
+
+threads="${*:-2 4 8}"
+failed=0
+while read -r args; do
+    ./fastMapper $args -t img -l 0 -o check_threads_1.png --propagation_threads 1 > /dev/null
+    for t in $threads; do
+        ./fastMapper $args -t img -l 0 -o check_threads_$t.png --propagation_threads $t > /dev/null
+        if ! cmp -s check_threads_1.png check_threads_$t.png; then
+            echo "DIFF  threads 1 vs $t : $args"
+            failed=1
+        fi
+    done
+done << EOF
+-h 120 -w 120 -s 8 -N 3 -i ../samples/Cat.png -r 3
+-h 80 -w 80 -s 8 -N 3 -i ../samples/City.png -r 5 -b 30 -a 3
+-h 60 -w 60 -s 8 -N 4 -i ../samples/Cat.png -r 2 -b 100
+-h 100 -w 100 -s 2 -N 3 -i ../samples/wall.png -r 7
+-h 90 -w 90 -s 8 -N 3 -i ../samples/Cat.png -r 4 --tile 30
+EOF
+
+rm -f check_threads_*.png
+[ $failed -eq 0 ] && echo "same output for threads 1 $threads"
+exit $failed
@@ -72,7 +72,8 @@ ext_modules = [
             get_pybind_include(user=True),
         ],
         language='c++',
-        extra_compile_args=["-std=c++11", "-D_hypot=hypot"],
+        extra_compile_args=["-std=c++11", "-D_hypot=hypot", "-pthread"],
+        extra_link_args=["-pthread"],
     ),
 ]
 
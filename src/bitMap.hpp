@@ -3,115 +3,249 @@
 
 #include <iostream>
 #include <cassert>
+#include <cstdint>
 #include <memory>
 #include <ostream>
 #include <memory.h>
 #include <bitset>
+#include <iterator>
+#include <cstddef>
+#include <utility>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// 64位字的位运算  位的顺序为低位在前  第 i 位在第 i/64 个字的第 i%64 位
+namespace bits {
+
+    inline unsigned popcount(uint64_t word) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        return (unsigned) __popcnt64(word);
+#else
+        unsigned n = 0;
+        for (; word; word &= word - 1) n++;
+        return n;
+#endif
+    }
+
+    // 最低的1所在的位置  word 不能为0
+    inline unsigned lowest(uint64_t word) noexcept {
+        assert(word);
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+        unsigned long index;
+        _BitScanForward64(&index, word);
+        return index;
+#else
+        unsigned n = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+
+    inline unsigned word_count(unsigned size) noexcept {
+        return (size + 63) / 64;
+    }
+
+    inline unsigned popcount(const uint64_t *words, unsigned word_size) noexcept {
+        unsigned n = 0;
+        for (unsigned i = 0; i < word_size; i++) n += popcount(words[i]);
+        return n;
+    }
+
+    // 从 from 开始(包含)的下一个为1的位  没有则返回 size
+    inline unsigned find_next_set(const uint64_t *words, unsigned size, unsigned from) noexcept {
+        if (from >= size) return size;
+        unsigned w = from >> 6;
+        uint64_t word = words[w] & (~uint64_t(0) << (from & 63));
+        const unsigned word_size = word_count(size);
+        while (!word) {
+            if (++w >= word_size) return size;
+            word = words[w];
+        }
+        unsigned index = (w << 6) + lowest(word);
+        return index < size ? index : size;
+    }
+}
 
 class BitMap {
 public:
-    BitMap() = delete ;
+    BitMap() = delete;
 
-    BitMap(const BitMap& src): charSize(src.charSize),_size(src.size()),_markSize(src.markSize()) {
-        this->data = new uint8_t[charSize];
-        memcpy(this->data,src.data,charSize);
+    BitMap(unsigned _size) : wordSize(bits::word_count(_size)), _size(_size), _markSize(0) { // contractor, init the data
+        data = new uint64_t[wordSize > 0 ? wordSize : 1];
+        assert(data);
+        memset(data, 0x0, wordSize * sizeof(uint64_t));
     }
 
+    BitMap(const BitMap &src) : wordSize(src.wordSize), _size(src.size()), _markSize(src.markSize()) {
+        this->data = new uint64_t[wordSize > 0 ? wordSize : 1];
+        memcpy(this->data, src.data, wordSize * sizeof(uint64_t));
+    }
 
-    ~BitMap() {
-        delete data;
-        data = nullptr;
+    BitMap(BitMap &&src) noexcept: data(src.data), wordSize(src.wordSize), _size(src._size),
+                                   _markSize(src._markSize) {
+        src.data = nullptr;
+        src.wordSize = 0;
+        src._size = 0;
+        src._markSize = 0;
     }
 
-    BitMap(unsigned _size) : charSize((_size / 8) + 1),_size(_size) { // contractor, init the data
-        data = new uint8_t[charSize];
-        assert(data);
-        memset(data, 0x0, charSize * sizeof(uint8_t));
-        this->_markSize = 0;
+    BitMap &operator=(BitMap src) noexcept {
+        std::swap(data, src.data);
+        std::swap(wordSize, src.wordSize);
+        std::swap(_size, src._size);
+        std::swap(_markSize, src._markSize);
+        return *this;
+    }
+
+    ~BitMap() {
+        delete[] data;
+        data = nullptr;
     }
 
     void set(unsigned index, bool status) {
+        assert(index < _size);
+        uint64_t &word = data[index >> 6];
+        const uint64_t mask = uint64_t(1) << (index & 63);
+        if (((word & mask) != 0) == status) return;
+        word ^= mask;
         if (status) {
-            setTrue(index);
+            _markSize++;
         } else {
-            setFalse(index);
+            _markSize--;
         }
     }
 
-    template <class T>
+    template<class T>
     bool get(T index) const {
-        unsigned addr = index / 8;
-        unsigned addroffset = index % 8;
-        uint8_t temp = 0x1 << (7 - addroffset);
-        assert(addr <= charSize);
-        return (data[addr] & temp) > 0 ? 1 : 0;
+        assert((unsigned) index < _size);
+        return (data[index >> 6] >> (index & 63)) & 1;
     }
 
-    inline unsigned size() const{
+    inline unsigned size() const {
         return this->_size;
     }
-    inline unsigned markSize() const{
+
+    // 为1的位数  set 时增量维护  整体运算后重新统计
+    inline unsigned markSize() const {
         return this->_markSize;
     }
 
-private:
+    unsigned popcount() const noexcept {
+        return bits::popcount(data, wordSize);
+    }
 
-    void setTrue(unsigned index) {
-        if (get(index)) {
-            return;
+    bool any() const noexcept {
+        for (unsigned i = 0; i < wordSize; i++) {
+            if (data[i]) return true;
         }
-        unsigned addr = index / 8;
-        unsigned addroffset = index % 8;
-        uint8_t temp = 0x1 << (7 - addroffset);
-        assert (addr <= charSize + 1);
-        data[addr] |= temp;
-        _markSize++;
+        return false;
+    }
+
+    // 从 from 开始(包含)的下一个为1的位  没有则返回 size()
+    unsigned find_next_set(unsigned from) const noexcept {
+        return bits::find_next_set(data, _size, from);
     }
 
-    void set(unsigned charId, unsigned bitId, bool status) {
-        unsigned index = charId * 8 + bitId;
-        set(index, status);
+    // 以下整体运算每次处理64位  两个位图的大小必须相同
+    void and_with(const BitMap &map) noexcept {
+        assert(map._size == _size);
+        for (unsigned i = 0; i < wordSize; i++) data[i] &= map.data[i];
+        _markSize = popcount();
     }
 
-    bool get(unsigned charId, unsigned bitId) {
-        unsigned index = charId * 8 + bitId;
-        return get(index);
+    void andnot_with(const BitMap &map) noexcept {
+        assert(map._size == _size);
+        for (unsigned i = 0; i < wordSize; i++) data[i] &= ~map.data[i];
+        _markSize = popcount();
     }
 
+    void or_with(const BitMap &map) noexcept {
+        assert(map._size == _size);
+        for (unsigned i = 0; i < wordSize; i++) data[i] |= map.data[i];
+        _markSize = popcount();
+    }
+
+    const uint64_t *words() const noexcept {
+        return data;
+    }
+
+    unsigned word_size() const noexcept {
+        return wordSize;
+    }
+
+    // 遍历所有为1的位
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef unsigned value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const unsigned *pointer;
+        typedef unsigned reference;
+
+        const_iterator(const BitMap *map, unsigned index) : map(map), index(index) {}
+
+        unsigned operator*() const noexcept {
+            return index;
+        }
+
+        const_iterator &operator++() noexcept {
+            index = map->find_next_set(index + 1);
+            return *this;
+        }
 
-    void setFalse(unsigned index) {
-        if (!get(index)) {
-            return;
+        const_iterator operator++(int) noexcept {
+            const_iterator res = *this;
+            ++(*this);
+            return res;
         }
-        unsigned addr = index / 8;
-        unsigned addroffset = index % 8;
-        uint8_t temp = 0x1 << (7 - addroffset);
-        assert(addr <= charSize);
-        data[addr] ^= temp;
-        assert(_markSize>=0);
-        _markSize--;
+
+        bool operator==(const const_iterator &it) const noexcept {
+            return index == it.index;
+        }
+
+        bool operator!=(const const_iterator &it) const noexcept {
+            return index != it.index;
+        }
+
+    private:
+        const BitMap *map;
+        unsigned index;
+    };
+
+    const_iterator begin() const noexcept {
+        return const_iterator(this, find_next_set(0));
     }
 
-    //把一个字符的8位设置为值
-    void setNumber(unsigned index, uint8_t number) {
-        data[index] = number;
-        return;
+    const_iterator end() const noexcept {
+        return const_iterator(this, _size);
     }
 
+private:
+
     friend std::ostream &operator<<(std::ostream &os, const BitMap &map) {
-        for (unsigned i = 0; i < map.charSize; i++) {
-            os << std::bitset<8>(map.data[i]) << "  ";
+        for (unsigned i = 0; i < map._size; i++) {
+            os << map.get(i);
+            if (i % 8 == 7) os << "  ";
         }
         os << std::endl;
         return os;
     }
 
 private:
-    uint8_t *data;
-    unsigned charSize;
+    uint64_t *data;
+    unsigned wordSize;
     unsigned _size;
     unsigned _markSize;
 };
 
 
-#endif // BITMAP_HPP
\ No newline at end of file
+#endif // BITMAP_HPP
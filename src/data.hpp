@@ -4,6 +4,8 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <cstdint>
+#include <limits>
 
 #include "declare.hpp"
 //#include "MyRtree.hpp"
@@ -13,35 +15,212 @@ using namespace std;
 template<typename T>
 class Matrix;
 
+// 回溯日志  记录的位置从 clear() 起单调递增 丢弃最早的部分后其余记录的位置不变
+// 丢弃的部分不少于保留的部分时才整体移出  每条记录平均只移动一次
+template<class Record>
+class Journal {
+public:
+    Journal() : base(0), start(0) {}
+
+    void push_back(const Record &record) {
+        records.push_back(record);
+    }
+
+    template<class Iterator>
+    void append(Iterator begin, Iterator end) {
+        records.insert(records.end(), begin, end);
+    }
+
+    Record &back() noexcept {
+        return records.back();
+    }
+
+    // 只能撤销到 discard_before 保留的部分
+    void pop_back() noexcept {
+        assert(records.size() > start);
+        records.pop_back();
+    }
+
+    // 下一条记录的位置
+    size_t size() const noexcept {
+        return base + records.size();
+    }
+
+    // 位置在 position 之前的记录不会再被撤销
+    void discard_before(size_t position) {
+        assert(base + start <= position && position <= size());
+        start = position - base;
+        if (start < records.size() - start) return;
+        records.erase(records.begin(), records.begin() + start);
+        base += start;
+        start = 0;
+    }
+
+    void clear() noexcept {
+        records.clear();
+        base = 0;
+        start = 0;
+    }
+
+private:
+    std::vector<Record> records;
+    size_t base;    // records[0] 的位置
+    size_t start;   // records 中第一条保留的记录
+};
+
+// 兼容计数表  按 [wave][direction][fea] 连续排列
+// 记录某个wave上的某个图案 在某个方向上还剩多少个可兼容的图案 为0时该图案就要被ban掉
+// 开启日志后记录每一次自减的位置  回溯时按相反顺序加回去  位置用32位保存 计数表超过这个范围时不能开启日志
+template<class Count>
+class CompatibleCount {
+public:
+    CompatibleCount() : direction_size(0), fea_size(0), journaling(false) {}
+
+    // 以一个 [direction][fea] 的模板行整体初始化所有wave
+    void init(unsigned wave_size, unsigned direction_size, unsigned fea_size, const std::vector<Count> &row) {
+        assert(row.size() == (size_t) direction_size * fea_size);
+        this->direction_size = direction_size;
+        this->fea_size = fea_size;
+        count.resize((size_t) wave_size * row.size());
+        for (unsigned i = 0; i < wave_size; i++) {
+            std::copy(row.begin(), row.end(), count.data() + (size_t) i * row.size());
+        }
+        journal.clear();
+    }
+
+    Count &get(unsigned wave_id, unsigned fea_id, unsigned direction) noexcept {
+        return count[((size_t) wave_id * direction_size + direction) * fea_size + fea_id];
+    }
+
+    // 计数减一并返回新的值  调用前计数必须大于0
+    Count decrement(unsigned wave_id, unsigned fea_id, unsigned direction) noexcept {
+        const size_t index = ((size_t) wave_id * direction_size + direction) * fea_size + fea_id;
+        assert(count[index] > 0);
+        if (journaling) journal.push_back((uint32_t) index);
+        return --count[index];
+    }
+
+    // 并行传播时每个线程记在自己的日志里  结束后用 append_journal 合并
+    // 撤销只是把计数加回去 与日志的顺序无关
+    Count decrement(unsigned wave_id, unsigned fea_id, unsigned direction, std::vector<uint32_t> &part) noexcept {
+        const size_t index = ((size_t) wave_id * direction_size + direction) * fea_size + fea_id;
+        assert(count[index] > 0);
+        if (journaling) part.push_back((uint32_t) index);
+        return --count[index];
+    }
+
+    void append_journal(const std::vector<uint32_t> &part) {
+        journal.append(part.begin(), part.end());
+    }
+
+    // 计数表的位置都能用32位表示
+    bool can_journal() const noexcept {
+        return count.size() <= std::numeric_limits<uint32_t>::max();
+    }
+
+    void set_journaling(bool status) noexcept {
+        assert(!status || can_journal());
+        journaling = status;
+    }
+
+    size_t journal_size() const noexcept {
+        return journal.size();
+    }
+
+    // 撤销日志中 size 之后的所有自减
+    void rollback(size_t size) noexcept {
+        while (journal.size() > size) {
+            count[journal.back()]++;
+            journal.pop_back();
+        }
+    }
+
+    // 不会再回溯到 size 之前  这部分日志不再需要
+    void discard_journal(size_t size) {
+        journal.discard_before(size);
+    }
+
+    void clear() {
+        count = unit::AlignedArray<Count>();
+        journal.clear();
+    }
+
+private:
+    unsigned direction_size;
+    unsigned fea_size;
+    unit::AlignedArray<Count> count;
+    bool journaling;
+    Journal<uint32_t> journal;      // 自减过的位置
+};
+
 template<class T, class AbstractFeature>
 class Data {
 public:
-    Data(){
+    explicit Data(Context *ctx) : ctx(ctx), narrow(true) {
 
     }
-    template<class KEY>
-    long long getKey(KEY wave_id, KEY fea_id, KEY direction_id) {
-        return wave_id * conf->wave_size + fea_id * feature.size() + direction_id;
+
+    // 图案数量小于65536时 计数不会超过uint16的范围 用窄类型减少一半内存带宽
+    void init_compatible_count() {
+        narrow = ctx->model->is_narrow();
+        if (narrow) {
+            wide_count.clear();
+            init_compatible_count(narrow_count);
+        } else {
+            narrow_count.clear();
+            init_compatible_count(wide_count);
+        }
     }
 
+    bool is_narrow() const {
+        return narrow;
+    }
 
-    //没找到 就初始化  那就不用在最初进行初始化了 省了很多事
-    int &getDirectionCount(const unsigned &wave_id, const unsigned &fea_id, const unsigned &direction) {
-        auto iter = compatible_feature_map.find(getKey(wave_id, fea_id, direction));
+    // 以下转发到当前使用的计数表  用于回溯
+    bool can_journal() const {
+        return narrow ? narrow_count.can_journal() : wide_count.can_journal();
+    }
 
-        if (iter == compatible_feature_map.end()) {
-            //一个fea_id和一个direction唯一确定一个方向
-            unsigned oppositeDirection = _direction.get_opposite_direction(fea_id, direction);
+    void set_journaling(bool status) {
+        narrow ? narrow_count.set_journaling(status) : wide_count.set_journaling(status);
+    }
 
-            //此方向上的值  等于 其反方向上的可传播大小
-            long long key = getKey(wave_id, fea_id, direction);
-            compatible_feature_map[key] = propagator[fea_id][oppositeDirection].markSize();
-            return compatible_feature_map[key];
-        }
+    size_t journal_size() const {
+        return narrow ? narrow_count.journal_size() : wide_count.journal_size();
+    }
+
+    void rollback(size_t size) {
+        narrow ? narrow_count.rollback(size) : wide_count.rollback(size);
+    }
 
-        return iter->second;
+    void discard_journal(size_t size) {
+        narrow ? narrow_count.discard_journal(size) : wide_count.discard_journal(size);
     }
 
+    CompatibleCount<uint16_t> narrow_count;
+    CompatibleCount<uint32_t> wide_count;
+
+private:
+    Context *ctx;
+
+    bool narrow;
+
+    template<class Count>
+    void init_compatible_count(CompatibleCount<Count> &count) {
+        const unsigned direction_size = ctx->model->_direction.getMaxNumber();
+        std::vector<Count> row((size_t) direction_size * ctx->model->feature_size());
+        for (unsigned direction = 0; direction < direction_size; direction++) {
+            for (unsigned fea_id = 0; fea_id < ctx->model->feature_size(); fea_id++) {
+                //一个fea_id和一个direction唯一确定一个方向
+                unsigned oppositeDirection = ctx->model->_direction.get_opposite_direction(fea_id, direction);
+                //此方向上的值  等于 其反方向上的可传播大小
+                row[(size_t) direction * ctx->model->feature_size() + fea_id] = ctx->model->compatible_size(fea_id, oppositeDirection);
+            }
+        }
+        count.init(ctx->conf.wave_size, direction_size, ctx->model->feature_size(), row);
+    }
+
+public:
     template< class ImgAbstractFeature>
     void write_image_png(const std::string &file_path, const ImgAbstractFeature &m) noexcept {
         unsigned char *imgData = new unsigned char[m.getHeight() * m.getWidth() * 3];
@@ -56,38 +235,38 @@ public:
 
     //matrix 写入图像
     Matrix<unsigned> to_image( Matrix<unsigned> output_features) const noexcept {
-        Matrix<unsigned> res = Matrix<unsigned>(conf->out_height, conf->out_width);
+        Matrix<unsigned> res = Matrix<unsigned>(ctx->conf.out_height, ctx->conf.out_width);
 
         //写入主要区域的数据
-        for (unsigned y = 0; y < conf->wave_height; y++) {
-            for (unsigned x = 0; x < conf->wave_width; x++) {
-                res.get(y, x) = feature[output_features.get(y, x)].get(0, 0);
+        for (unsigned y = 0; y < ctx->conf.wave_height; y++) {
+            for (unsigned x = 0; x < ctx->conf.wave_width; x++) {
+                res.get(y, x) = ctx->model->pattern(output_features.get(y, x))[0];
             }
         }
         // 下面的三次写入是处理边缘条件
 
         //写入左边部分
-        for (unsigned y = 0; y < conf->wave_height; y++) {
-            const Matrix<unsigned> &fea = feature[output_features.get(y, conf->wave_width - 1)];
-            for (unsigned dx = 1; dx < conf->N; dx++) {
-                res.get(y, conf->wave_width - 1 + dx) = fea.get(0, dx);
+        for (unsigned y = 0; y < ctx->conf.wave_height; y++) {
+            const uint32_t *fea = ctx->model->pattern(output_features.get(y, ctx->conf.wave_width - 1));
+            for (unsigned dx = 1; dx < ctx->conf.N; dx++) {
+                res.get(y, ctx->conf.wave_width - 1 + dx) = fea[dx];
             }
         }
 
         //写入下边部分
-        for (unsigned x = 0; x < conf->wave_width; x++) {
-            const Matrix<unsigned> &fea = feature[output_features.get(conf->wave_height - 1, x)];
-            for (unsigned dy = 1; dy < conf->N; dy++) {
-                res.get(conf->wave_height - 1 + dy, x) = fea.get(dy, 0);
+        for (unsigned x = 0; x < ctx->conf.wave_width; x++) {
+            const uint32_t *fea = ctx->model->pattern(output_features.get(ctx->conf.wave_height - 1, x));
+            for (unsigned dy = 1; dy < ctx->conf.N; dy++) {
+                res.get(ctx->conf.wave_height - 1 + dy, x) = fea[dy * ctx->conf.N];
             }
         }
 
         //写入右下角的一小块
-        const Matrix<unsigned> &fea = feature[output_features.get(conf->wave_height - 1,
-                                                                    conf->wave_width - 1)];
-        for (unsigned dy = 1; dy < conf->N; dy++) {
-            for (unsigned dx = 1; dx < conf->N; dx++) {
-                res.get(conf->wave_height - 1 + dy, conf->wave_width - 1 + dx) = fea.get(dy, dx);
+        const uint32_t *fea = ctx->model->pattern(output_features.get(ctx->conf.wave_height - 1,
+                                                                      ctx->conf.wave_width - 1));
+        for (unsigned dy = 1; dy < ctx->conf.N; dy++) {
+            for (unsigned dx = 1; dx < ctx->conf.N; dx++) {
+                res.get(ctx->conf.wave_height - 1 + dy, ctx->conf.wave_width - 1 + dx) = fea[dy * ctx->conf.N + dx];
             }
         }
         return res;
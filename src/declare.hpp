@@ -7,6 +7,9 @@
 #include <vector>
 #include <iostream>
 #include <ctime>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 
 #define STB_IMAGE_IMPLEMENTATION
 
@@ -18,6 +21,7 @@
 
 #include "unit.hpp"
 #include "bitMap.hpp"
+#include "sparsePropagator.hpp"
 #include "include/cmdline.h"
 
 using namespace std;
@@ -38,6 +42,23 @@ enum ObserveStatus {
     amount_flag,
 };
 
+// 传播方式
+enum class Propagation {
+    ac4,    // 逐个图案的兼容计数
+    ac3,    // 逐个wave的位掩码
+};
+
+// 只接受 "ac4" 和 "ac3"  其它值抛出 std::invalid_argument
+inline Propagation parse_propagation(const std::string &name) {
+    if (name == "ac4") return Propagation::ac4;
+    if (name == "ac3") return Propagation::ac3;
+    throw std::invalid_argument("unknown propagation \"" + name + "\", expected ac4 or ac3");
+}
+
+inline std::string propagation_name(Propagation propagation) {
+    return propagation == Propagation::ac3 ? "ac3" : "ac4";
+}
+
 
 class Config {
 public:
@@ -50,6 +71,16 @@ public:
     std::string input_data; // The width and height in pixel of the feature.
     std::string output_data; // The width and height in pixel of the feature.
     std::string type;        // 模式
+    int noise;               // 为每个wave的熵加上一个很小的随机噪声 打破熵相同时的平局
+    unsigned threads;        // 构建传播表的线程数  0表示使用所有硬件线程
+    unsigned backtrack;      // 遇到矛盾时最多回溯的次数  0表示不回溯 直接失败
+    unsigned max_attempts;   // 失败后换一个种子重新生成 最多尝试的次数
+    uint64_t seed;           // 第一次尝试的种子  0表示随机选取
+    Propagation propagation; // 传播方式  构造时从名称解析 未知的名称抛出 std::invalid_argument
+    unsigned tile;           // 分块生成时每块的边长(以wave计)  0表示整张图一次生成
+    unsigned tile_overlap;   // 分块生成时每块向已完成区域多重新生成的宽度 用来消除接缝
+    unsigned propagation_threads; // 传播使用的线程数  大于1时按行分区并行传播 只用于 ac4
+    unsigned race;           // 大于1时用这么多个种子同时生成 取最先成功的一个
 
     unsigned wave_height;  // The height of the output in pixels.
     unsigned wave_width;   // The width of the output in pixels.
@@ -57,7 +88,10 @@ public:
     unsigned wave_size;   // The width of the output in pixels.
 
     Config(unsigned out_height, unsigned out_width, unsigned symmetry, unsigned N, int channels, int log,
-           string input_data, std::string output_data, std::string type) :
+           string input_data, std::string output_data, std::string type, int noise = 0,
+           unsigned threads = 0, unsigned backtrack = 0, unsigned max_attempts = 1, uint64_t seed = 0,
+           std::string propagation = "ac4", unsigned tile = 0, unsigned tile_overlap = 2,
+           unsigned propagation_threads = 1, unsigned race = 1) :
             out_height(out_height),
             out_width(out_width),
             symmetry(symmetry),
@@ -67,10 +101,20 @@ public:
             input_data(std::move(input_data)),
             output_data(std::move(output_data)),
             type(std::move(type)),
+            noise(noise),
+            threads(threads),
+            backtrack(backtrack),
+            max_attempts(max_attempts > 0 ? max_attempts : 1),
+            seed(seed),
+            propagation(parse_propagation(propagation)),
+            tile(tile),
+            tile_overlap(tile_overlap),
+            propagation_threads(propagation_threads),
+            race(race),
             wave_height(out_height - N + 1),
             wave_width(out_width - N + 1),
             wave_size(wave_height * wave_width) {
-        showLog();
+        if (log) showLog();
     }
 
     Config() {
@@ -89,21 +133,21 @@ public:
              << "input_data               : " << this->input_data << endl
              << "output_data              : " << this->output_data << endl
              << "type                     : " << this->type << endl
+             << "noise                    : " << this->noise << endl
+             << "threads                  : " << this->threads << endl
+             << "backtrack                : " << this->backtrack << endl
+             << "max_attempts             : " << this->max_attempts << endl
+             << "seed                     : " << this->seed << endl
+             << "propagation              : " << propagation_name(this->propagation) << endl
+             << "tile                     : " << this->tile << endl
+             << "tile_overlap             : " << this->tile_overlap << endl
+             << "propagation_threads      : " << this->propagation_threads << endl
+             << "race                     : " << this->race << endl
              << "==================================" << endl;
     }
-
-    static Config *op;
-
-    static Config *getOp();
 };
 
 
-Config *Config::op = new Config;
-
-Config *Config::getOp() { return op; };
-Config *conf = Config::getOp();
-
-
 //需要弱化方向的概念 让方向与模型适配
 class DirectionSet {
 public:
@@ -128,24 +172,24 @@ public:
     }
 
 
-    int getX(unsigned directionId) {
+    int getX(unsigned directionId) const {
         return this->getDirect(directionId).first;
     }
 
-    int getY(unsigned directionId) {
+    int getY(unsigned directionId) const {
         return this->getDirect(directionId).second;
     }
 
-    unsigned get_opposite_direction(unsigned fea_id, unsigned id) noexcept {
+    unsigned get_opposite_direction(unsigned fea_id, unsigned id) const noexcept {
         return ((_direct.size() >> 1) + id) % _direct.size();
     }
 
-    unsigned getMaxNumber() {
+    unsigned getMaxNumber() const {
         return _direct.size();
     }
 
-    int movePatternByDirection(unsigned wave_id, unsigned dId, unsigned wave_width) {
-        std::pair<int, int> &direction = _direct[dId];
+    int movePatternByDirection(unsigned wave_id, unsigned dId, unsigned wave_width) const {
+        const std::pair<int, int> &direction = _direct[dId];
         return wave_id + direction.first + direction.second * wave_width;
     }
 
@@ -153,6 +197,10 @@ public:
         return this->_direct[dId];
     }
 
+    const std::pair<int, int> &getDirect(unsigned dId) const {
+        return this->_direct[dId];
+    }
+
     std::vector<std::pair<int, int>> &getDirect() {
         return this->_direct;
     }
@@ -220,22 +268,31 @@ public:
 
     Matrix<T> reflected() const noexcept {
         Matrix<T> result = Matrix<T>(width, height);
+        reflected(result);
+        return result;
+    }
+
+    // 结果写入已分配好大小的 result  用于重复生成时复用内存
+    void reflected(Matrix<T> &result) const noexcept {
         for (unsigned y = 0; y < height; y++) {
             for (unsigned x = 0; x < width; x++) {
                 result.get(y, x) = get(y, width - 1 - x);
             }
         }
-        return result;
     }
 
     Matrix<T> rotated() const noexcept {
         Matrix<T> result = Matrix<T>(width, height);
+        rotated(result);
+        return result;
+    }
+
+    void rotated(Matrix<T> &result) const noexcept {
         for (unsigned y = 0; y < width; y++) {
             for (unsigned x = 0; x < height; x++) {
                 result.get(y, x) = get(x, width - 1 - y);
             }
         }
-        return result;
     }
 
 
@@ -251,6 +308,11 @@ public:
         return sub_array_2d;
     }
 
+    Matrix(const Matrix<T> &) = default;
+
+    // 移动时直接接管像素缓冲区  返回给 NumPy 的结果不需要复制
+    Matrix(Matrix<T> &&) noexcept = default;
+
     Matrix<T> &operator=(const Matrix<T> &a) noexcept {
         height = a.height;
         width = a.width;
@@ -258,6 +320,13 @@ public:
         return *this;
     }
 
+    Matrix<T> &operator=(Matrix<T> &&a) noexcept {
+        height = a.height;
+        width = a.width;
+        data = std::move(a.data);
+        return *this;
+    }
+
 
     bool operator==(const Matrix<T> &a) const noexcept {
         if (height != a.height || width != a.width) {
@@ -296,14 +365,204 @@ namespace std {
 }
 using AbstractFeature   = Matrix<unsigned>;
 
-// 全局数据
-//    std::vector<std::vector<svgPoint *>> data;      //原始的数据
-DirectionSet _direction = DirectionSet(8);
-std::vector<std::vector<BitMap>> propagator;
-std::vector<AbstractFeature> feature;                             //图案数据
-std::vector<unsigned> features_frequency;                         //图案频率
+// 从输入中编译得到的规则集: 方向 图案 图案频率 传播表
+// 构建一次后只读  可以被任意多次 任意尺寸的生成共享(包括不同线程上同时进行的生成)
+class Model : public std::enable_shared_from_this<Model> {
+public:
+    explicit Model(const Config &conf) : Model(conf.N, conf.symmetry, conf.channels, conf.type) {}
+
+    Model(unsigned N, unsigned symmetry, unsigned channels, std::string type)
+            : N(N), symmetry(symmetry), channels(channels), type(std::move(type)), _direction(8), fea_size(0),
+              pattern_view(nullptr), frequency_view(nullptr) {}
+
+    Model(const Model &) = delete;
+
+    Model &operator=(const Model &) = delete;
+
+    unsigned N;         // 图案的边长
+    unsigned symmetry;  // 构建时使用的对称数
+    unsigned channels;  // 输入的通道数
+    std::string type;   // 模式
+
+    DirectionSet _direction;
+
+    // 以下三项只在构建时使用  compile() 之后清空
+    std::vector<std::vector<BitMap>> propagator;
+    std::vector<AbstractFeature> feature;                             //图案数据
+    std::vector<unsigned> features_frequency;                         //图案频率
+
+    SparsePropagator<uint16_t> narrow_propagator;                     //propagator 的CSR形式 图案数小于65536时使用
+    SparsePropagator<uint32_t> wide_propagator;                       //propagator 的CSR形式 图案数较多时使用
+
+    unsigned feature_size() const noexcept {
+        return fea_size;
+    }
+
+    // 图案数量小于65536时 计数和CSR索引都使用16位
+    bool is_narrow() const noexcept {
+        return fea_size < 65536;
+    }
+
+    // 第 fea_id 个图案的 N*N 个像素  按行连续存放
+    const uint32_t *pattern(unsigned fea_id) const noexcept {
+        return pattern_view + (size_t) fea_id * N * N;
+    }
+
+    unsigned frequency(unsigned fea_id) const noexcept {
+        return frequency_view[fea_id];
+    }
+
+    const uint32_t *frequencies() const noexcept {
+        return frequency_view;
+    }
+
+    // fea_id 在 direction 方向上可兼容的图案数
+    size_t compatible_size(unsigned fea_id, unsigned direction) const noexcept {
+        return is_narrow() ? narrow_propagator.size(fea_id, direction) : wide_propagator.size(fea_id, direction);
+    }
+
+    unsigned word_size() const noexcept {
+        return bits::word_count(fea_size);
+    }
+
+    // 位掩码传播使用  dst |= 与 fea_id 在 direction 方向上兼容的图案
+    void or_compatible(uint64_t *dst, unsigned fea_id, unsigned direction) const noexcept {
+        const uint64_t *dense_row = get_dense_row(fea_id, direction);
+        if (dense_row) {
+            for (unsigned w = 0, words = word_size(); w < words; w++) dst[w] |= dense_row[w];
+        } else if (is_narrow()) {
+            set_bits(dst, narrow_propagator.begin(fea_id, direction), narrow_propagator.end(fea_id, direction));
+        } else {
+            set_bits(dst, wide_propagator.begin(fea_id, direction), wide_propagator.end(fea_id, direction));
+        }
+    }
+
+    // row 中是否有与 fea_id 在 direction 方向上兼容的图案
+    bool any_compatible(const uint64_t *row, unsigned fea_id, unsigned direction) const noexcept {
+        const uint64_t *dense_row = get_dense_row(fea_id, direction);
+        if (dense_row) {
+            for (unsigned w = 0, words = word_size(); w < words; w++) {
+                if (dense_row[w] & row[w]) return true;
+            }
+            return false;
+        } else if (is_narrow()) {
+            return any_bit(row, narrow_propagator.begin(fea_id, direction), narrow_propagator.end(fea_id, direction));
+        } else {
+            return any_bit(row, wide_propagator.begin(fea_id, direction), wide_propagator.end(fea_id, direction));
+        }
+    }
+
+    // 兼容图案不少于一行的字数时 按位整行处理比逐个遍历CSR更快  只为这些行生成稠密的位行
+    // 稠密部分的大小不超过CSR索引的8倍  第一次使用时生成 之后所有共享此模型的生成直接使用
+    void compile_dense() const {
+        std::call_once(dense_once, [this] {
+            const unsigned direction_size = _direction.getMaxNumber();
+            const unsigned words = word_size();
+            dense_offsets.assign((size_t) fea_size * direction_size, size_t(no_dense_row));
+            dense.clear();
+            for (unsigned fea_id = 0; fea_id < fea_size; fea_id++) {
+                for (unsigned direction = 0; direction < direction_size; direction++) {
+                    if (compatible_size(fea_id, direction) < words) continue;
+                    dense_offsets[(size_t) fea_id * direction_size + direction] = dense.size();
+                    dense.resize(dense.size() + words, 0);
+                    uint64_t *row = dense.data() + dense.size() - words;
+                    if (is_narrow()) {
+                        set_bits(row, narrow_propagator.begin(fea_id, direction), narrow_propagator.end(fea_id, direction));
+                    } else {
+                        set_bits(row, wide_propagator.begin(fea_id, direction), wide_propagator.end(fea_id, direction));
+                    }
+                }
+            }
+        });
+    }
+
+    // 把构建得到的图案 频率和位图形式的 propagator 编译为扁平数组和CSR  生成时只使用编译后的数据
+    void compile() {
+        static_assert(sizeof(unsigned) == sizeof(uint32_t), "pixels and frequencies are stored in 32 bits");
+        fea_size = feature.size();
+        pattern_data.resize((size_t) fea_size * N * N);
+        for (unsigned i = 0; i < fea_size; i++) {
+            std::copy(feature[i].data.begin(), feature[i].data.end(), pattern_data.begin() + (size_t) i * N * N);
+        }
+        frequency_data.assign(features_frequency.begin(), features_frequency.end());
+        pattern_view = pattern_data.data();
+        frequency_view = frequency_data.data();
+
+        if (is_narrow()) {
+            wide_propagator.clear();
+            narrow_propagator.build(propagator);
+        } else {
+            narrow_propagator.clear();
+            wide_propagator.build(propagator);
+        }
 
+        std::vector<std::vector<BitMap>>().swap(propagator);
+        std::vector<AbstractFeature>().swap(feature);
+        std::vector<unsigned>().swap(features_frequency);
+    }
+
+    // 让编译后的数据直接指向外部内存  storage 持有这块内存 与模型同生命周期
+    void attach(std::shared_ptr<const void> storage, unsigned fea_size, const uint32_t *patterns,
+                const uint32_t *frequencies) {
+        this->storage = std::move(storage);
+        this->fea_size = fea_size;
+        pattern_data.clear();
+        frequency_data.clear();
+        pattern_view = patterns;
+        frequency_view = frequencies;
+    }
+
+private:
+    unsigned fea_size;
+    std::vector<uint32_t> pattern_data;     // 构建得到的模型自己持有数据
+    std::vector<uint32_t> frequency_data;
+    std::shared_ptr<const void> storage;    // 从文件加载的模型持有映射的内存
+    const uint32_t *pattern_view;
+    const uint32_t *frequency_view;
+
+    static const size_t no_dense_row = ~size_t(0);
+
+    mutable std::once_flag dense_once;
+    mutable std::vector<size_t> dense_offsets;    // 每个 (fea_id, direction) 的稠密行在 dense 中的起点
+    mutable std::vector<uint64_t> dense;
+
+    const uint64_t *get_dense_row(unsigned fea_id, unsigned direction) const noexcept {
+        const size_t offset = dense_offsets[(size_t) fea_id * _direction.getMaxNumber() + direction];
+        return offset == no_dense_row ? nullptr : dense.data() + offset;
+    }
+
+    template<class Index>
+    static void set_bits(uint64_t *row, const Index *begin, const Index *end) noexcept {
+        for (const Index *it = begin; it != end; ++it) {
+            row[*it >> 6] |= uint64_t(1) << (*it & 63);
+        }
+    }
+
+    template<class Index>
+    static bool any_bit(const uint64_t *row, const Index *begin, const Index *end) noexcept {
+        for (const Index *it = begin; it != end; ++it) {
+            if ((row[*it >> 6] >> (*it & 63)) & 1) return true;
+        }
+        return false;
+    }
+};
+
+// 一次生成所需的全部数据  由 WFC 持有  不同的生成之间互不共享 可以在不同线程上同时运行
+// 规则集 model 是只读的  可以在多个 Context 之间共享
+class Context {
+public:
+    Context(const Config &conf, std::shared_ptr<const Model> model) : conf(conf), model(std::move(model)) {}
+
+    Context(const Context &) = delete;
+
+    Context &operator=(const Context &) = delete;
+
+    Config conf;
+    std::shared_ptr<const Model> model;
+
+    std::stack<std::tuple<unsigned, unsigned>> propagating;
+
+    unit::Random random;    // 每次尝试开始时用该次的种子重置
+};
 
-std::stack<std::tuple<unsigned, unsigned>> propagating;
-unordered_map<long long, int> compatible_feature_map;
 #endif
\ No newline at end of file
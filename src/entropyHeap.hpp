@@ -0,0 +1,120 @@
+#ifndef SRC_ENTROPYHEAP_HPP
+#define SRC_ENTROPYHEAP_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+// 以熵为键的索引最小堆
+// 记录每个wave在堆中的位置  熵变化时原地上浮或下沉  取最小熵的wave只需O(1) 更新O(log n)
+// 熵相同时 wave_id 小的在前  与逐个扫描时取第一个最小值的顺序一致
+class EntropyHeap {
+public:
+    enum { not_in_heap = -1 };
+
+    // 清空堆  wave_id 的范围为 [0, size)
+    void init(unsigned size) {
+        heap.clear();
+        heap.reserve(size);
+        pos.assign(size, not_in_heap);
+    }
+
+    bool empty() const noexcept {
+        return heap.empty();
+    }
+
+    unsigned size() const noexcept {
+        return heap.size();
+    }
+
+    bool contains(unsigned wave_id) const noexcept {
+        return pos[wave_id] != not_in_heap;
+    }
+
+    unsigned top() const noexcept {
+        assert(!heap.empty());
+        return heap[0].wave_id;
+    }
+
+    // wave不在堆中就插入  在堆中就更新它的熵
+    void update(unsigned wave_id, float entropy) noexcept {
+        if (!contains(wave_id)) {
+            pos[wave_id] = heap.size();
+            heap.push_back(Node(entropy, wave_id));
+            sift_up(heap.size() - 1);
+            return;
+        }
+
+        unsigned i = pos[wave_id];
+        float old_entropy = heap[i].entropy;
+        heap[i].entropy = entropy;
+        if (entropy < old_entropy) {
+            sift_up(i);
+        } else {
+            sift_down(i);
+        }
+    }
+
+    void remove(unsigned wave_id) noexcept {
+        if (!contains(wave_id)) return;
+
+        unsigned i = pos[wave_id];
+        pos[wave_id] = not_in_heap;
+        Node last = heap.back();
+        heap.pop_back();
+        if (i == heap.size()) return;
+
+        heap[i] = last;
+        pos[last.wave_id] = i;
+        sift_up(i);
+        sift_down(pos[last.wave_id]);
+    }
+
+private:
+    struct Node {
+        Node() : entropy(0), wave_id(0) {}
+
+        Node(float entropy, unsigned wave_id) : entropy(entropy), wave_id(wave_id) {}
+
+        bool operator<(const Node &n) const noexcept {
+            return entropy < n.entropy || (entropy == n.entropy && wave_id < n.wave_id);
+        }
+
+        float entropy;
+        unsigned wave_id;
+    };
+
+    std::vector<Node> heap;
+    std::vector<int> pos;   // wave_id 在堆中的下标  不在堆中为 not_in_heap
+
+    void swap_node(unsigned i, unsigned j) noexcept {
+        std::swap(heap[i], heap[j]);
+        pos[heap[i].wave_id] = i;
+        pos[heap[j].wave_id] = j;
+    }
+
+    void sift_up(unsigned i) noexcept {
+        while (i > 0) {
+            unsigned parent = (i - 1) / 2;
+            if (!(heap[i] < heap[parent])) break;
+            swap_node(i, parent);
+            i = parent;
+        }
+    }
+
+    void sift_down(unsigned i) noexcept {
+        const unsigned n = heap.size();
+        while (true) {
+            unsigned left = 2 * i + 1;
+            unsigned right = left + 1;
+            unsigned smallest = i;
+            if (left < n && heap[left] < heap[smallest]) smallest = left;
+            if (right < n && heap[right] < heap[smallest]) smallest = right;
+            if (smallest == i) break;
+            swap_node(i, smallest);
+            i = smallest;
+        }
+    }
+};
+
+#endif // SRC_ENTROPYHEAP_HPP
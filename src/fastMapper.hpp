@@ -3,30 +3,183 @@
 
 #include "wfc.hpp"
 #include "imageModel.hpp"
+#include "modelFile.hpp"
+#include "tiled.hpp"
+#include "race.hpp"
+#include "threadPool.hpp"
 //#include "svg.hpp"
 
 using namespace std;
 
-bool single_run(unsigned out_height,
-                unsigned out_width,
-                unsigned symmetry,
-                unsigned N,
-                int channels,
-                int log,
-                string input_data,
-                string output_data,
-                string type) {
-    srand((unsigned) time(NULL));
-
-//    input_data = "../samples/ai/wh1.svg";
-//    type = "svg";
+// 从输入构建规则集  之后可以用同一个规则集生成任意数量 任意尺寸的结果
+std::shared_ptr<Model> build_model(string input_data,
+                                   unsigned N,
+                                   unsigned symmetry,
+                                   int channels = 3,
+                                   unsigned threads = 0,
+                                   string type = "img",
+                                   int log = 0) {
+    Config conf(N, N, symmetry, N, channels, log, input_data, "", type, 0, threads);
+    Img<int, AbstractFeature> builder(conf);
+    return builder.build_model();
+}
 
-    conf = new Config(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type);
+// 把任意步长的 8 位图像打包为每像素一个32位整数  低8位起依次为 R G B  步长以字节为单位
+// channels 小于3时用第一个通道作为灰度  多于3时忽略其余通道
+Matrix<unsigned> pack_image(const uint8_t *pixels, unsigned height, unsigned width, unsigned channels,
+                            ptrdiff_t row_stride, ptrdiff_t column_stride, ptrdiff_t channel_stride) {
+    Matrix<unsigned> image(height, width);
+    for (unsigned y = 0; y < height; y++) {
+        for (unsigned x = 0; x < width; x++) {
+            const uint8_t *pixel = pixels + y * row_stride + x * column_stride;
+            unsigned value = 0;
+            for (unsigned c = 0; c < 3; c++) {
+                value |= (unsigned) pixel[channels < 3 ? 0 : c * channel_stride] << (8 * c);
+            }
+            image.get(y, x) = value;
+        }
+    }
+    return image;
+}
 
-    Img<int, AbstractFeature> data ;
+// 从内存中的图像构建规则集  image 由 pack_image 得到
+std::shared_ptr<Model> build_model(const Matrix<unsigned> &image,
+                                   unsigned N,
+                                   unsigned symmetry,
+                                   unsigned threads = 0,
+                                   int log = 0) {
+    Config conf(N, N, symmetry, N, 3, log, "", "", "img", 0, threads);
+    Img<int, AbstractFeature> builder(conf);
+    builder.set_input_image(image);
+    return builder.build_model();
+}
 
+// 用已经构建好的规则集生成一张图  只做观察和传播  失败时换种子重试 最多 max_attempts 次
+// tile 大于0且小于输出时分块生成  每块单独重试
+// 否则 race 大于1时用 race 个种子同时生成 取最先成功的一个
+// image 非空时返回生成结果的像素  output_data 可以为空 只在内存中返回
+// cancel 变为true后生成尽快结束 结果为失败
+RunResult generate(std::shared_ptr<const Model> model,
+                   unsigned out_height,
+                   unsigned out_width,
+                   string output_data,
+                   int noise = 0,
+                   int log = 0,
+                   unsigned backtrack = 0,
+                   unsigned max_attempts = 1,
+                   uint64_t seed = 0,
+                   string propagation = "ac4",
+                   unsigned tile = 0,
+                   unsigned tile_overlap = 2,
+                   unsigned propagation_threads = 1,
+                   unsigned race = 1,
+                   Matrix<unsigned> *image = nullptr,
+                   const std::atomic<bool> *cancel = nullptr) {
+    Config conf(out_height, out_width, model->symmetry, model->N, model->channels, log, "", output_data,
+                model->type, noise, 0, backtrack, max_attempts, seed, propagation, tile, tile_overlap,
+                propagation_threads, race);
+    if (tile > 0 && (tile < conf.wave_height || tile < conf.wave_width)) {
+        Tiled<Img<int, AbstractFeature>> tiled(conf, std::move(model));
+        tiled.set_cancel(cancel);
+        tiled.run();
+        if (image) *image = tiled.get_image();
+        return tiled.get_result();
+    }
+    if (race > 1) {
+        Race<Img<int, AbstractFeature>> racing(conf, std::move(model));
+        racing.set_cancel(cancel);
+        racing.run();
+        if (image) *image = racing.get_image();
+        return racing.get_result();
+    }
+    Img<int, AbstractFeature> data(conf, std::move(model));
+    data.set_cancel(cancel);
     data.run();
-    return true;
+    if (image) *image = data.get_image();
+    return data.get_result();
+}
+
+// count 张图各自使用的种子  互不重叠的派生种子段 seed 为0时随机选取
+std::vector<uint64_t> batch_seeds(uint64_t seed, unsigned count, unsigned max_attempts = 1) {
+    if (!seed) seed = unit::random_seed();
+    std::vector<uint64_t> seeds;
+    for (unsigned i = 0; i < count; i++) {
+        seeds.push_back(unit::derive_seed(seed, i * max_attempts));
+    }
+    return seeds;
+}
+
+// 用同一个规则集一次生成多张图  每个种子一张 在 threads 个线程中并行生成
+// paths 非空时第 i 张写入 paths[i]  images 非空时返回每张图的像素 低8位起依次为 R G B
+std::vector<RunResult> generate_batch(std::shared_ptr<const Model> model,
+                                      unsigned out_height,
+                                      unsigned out_width,
+                                      const std::vector<uint64_t> &seeds,
+                                      const std::vector<std::string> &paths = std::vector<std::string>(),
+                                      std::vector<Matrix<unsigned>> *images = nullptr,
+                                      unsigned threads = 0,
+                                      int noise = 0,
+                                      int log = 0,
+                                      unsigned backtrack = 0,
+                                      unsigned max_attempts = 1,
+                                      string propagation = "ac4",
+                                      unsigned propagation_threads = 1) {
+    assert(paths.empty() || paths.size() == seeds.size());
+    parse_propagation(propagation);     // 未知的传播方式在提交任何生成之前抛出
+    std::vector<RunResult> results(seeds.size());
+    if (images) images->assign(seeds.size(), Matrix<unsigned>());
+
+    ThreadPool pool(std::min<unsigned>(ThreadPool::get_thread_number(threads), std::max<size_t>(seeds.size(), 1)));
+    std::vector<std::future<void>> jobs;
+    for (unsigned i = 0; i < seeds.size(); i++) {
+        jobs.push_back(pool.submit([&, i] {
+            Config conf(out_height, out_width, model->symmetry, model->N, model->channels, 0, "",
+                        paths.empty() ? "" : paths[i], model->type, noise, 0, backtrack, max_attempts, seeds[i],
+                        propagation, 0, 2, propagation_threads);
+            Img<int, AbstractFeature> data(conf, model);
+            data.run();
+            results[i] = data.get_result();
+            if (images) (*images)[i] = data.get_image();
+        }));
+    }
+    for (std::future<void> &job : jobs) {
+        job.get();
+    }
+
+    if (log) {
+        unsigned succeeded = 0;
+        for (const RunResult &res : results) succeeded += res.success;
+        std::cout << "batch  " << succeeded << " / " << results.size() << " succeeded" << std::endl;
+    }
+    return results;
+}
+
+// 从输入构建规则集并生成一张图  返回的 seed 和 attempts 可以用来复现成功的结果
+RunResult single_run(unsigned out_height,
+                     unsigned out_width,
+                     unsigned symmetry,
+                     unsigned N,
+                     int channels,
+                     int log,
+                     string input_data,
+                     string output_data,
+                     string type,
+                     int noise = 0,
+                     unsigned threads = 0,
+                     unsigned backtrack = 0,
+                     unsigned max_attempts = 1,
+                     uint64_t seed = 0,
+                     string propagation = "ac4",
+                     unsigned tile = 0,
+                     unsigned tile_overlap = 2,
+                     unsigned propagation_threads = 1,
+                     unsigned race = 1) {
+//    input_data = "../samples/ai/wh1.svg";
+//    type = "svg";
+
+    std::shared_ptr<Model> model = build_model(input_data, N, symmetry, channels, threads, type, log);
+    return generate(model, out_height, out_width, output_data, noise, log, backtrack, max_attempts, seed, propagation, tile,
+                    tile_overlap, propagation_threads, race);
 }
 
 
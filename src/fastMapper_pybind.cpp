@@ -1,15 +1,161 @@
 #include<pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include <pybind11/numpy.h>
 #include <iostream>
 #include <random>
 #include <string>
 #include <unordered_set>
 #include <ctime>
+#include <atomic>
+#include <functional>
 
 #include "fastMapper.hpp"
 
 using namespace std;
 namespace py = pybind11;
 
+// RunResult 转为 dict
+static py::dict to_dict(const RunResult &res) {
+    py::dict result;
+    result["success"] = res.success;
+    result["seed"] = res.seed;
+    result["attempts"] = res.attempts;
+    result["contradictions"] = res.contradictions;
+    result["backtracks"] = res.backtracks;
+    return result;
+}
+
+// 像素矩阵转为按行排列的 RGB 字节  height * width * 3
+static py::bytes to_rgb_bytes(const Matrix<unsigned> &image) {
+    std::string rgb((size_t) image.getHeight() * image.getWidth() * 3, '\0');
+    for (size_t i = 0; i < image.data.size(); i++) {
+        rgb[i * 3 + 0] = (char) (image.data[i] & 0xFF);
+        rgb[i * 3 + 1] = (char) ((image.data[i] >> 8) & 0xFF);
+        rgb[i * 3 + 2] = (char) ((image.data[i] >> 16) & 0xFF);
+    }
+    return py::bytes(rgb);
+}
+
+// 生成结果直接作为 NumPy 数组返回  不复制
+// 数组的内存就是结果的32位像素缓冲区 形状 (height, width, 3) 步长 (width * 4, 4, 1)  由 capsule 持有并在数组释放时删除
+static py::array to_array(Matrix<unsigned> image) {
+    const py::ssize_t height = image.getHeight();
+    const py::ssize_t width = image.getWidth();
+    std::vector<unsigned> *buffer = new std::vector<unsigned>();
+    buffer->swap(image.data);
+    py::capsule owner(buffer, [](void *p) { delete static_cast<std::vector<unsigned> *>(p); });
+
+    // R 在低8位  大端机器上 R 是每个像素的最后一个字节 通道步长取 -1
+    const uint32_t one = 1;
+    const bool little_endian = *reinterpret_cast<const uint8_t *>(&one) == 1;
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(buffer->data());
+    return py::array(py::dtype::of<uint8_t>(),
+                     {height, width, (py::ssize_t) 3},
+                     {width * 4, (py::ssize_t) 4, (py::ssize_t) (little_endian ? 1 : -1)},
+                     little_endian ? bytes : bytes + 3, owner);
+}
+
+// 通过 buffer protocol 读取 uint8 的 (height, width) 或 (height, width, channels) 数组  支持任意步长
+// 高和宽都不能小于图案边长 N  否则取不出任何图案
+static Matrix<unsigned> from_buffer(const py::buffer &input, unsigned N) {
+    py::buffer_info info = input.request();
+    if (info.format != py::format_descriptor<uint8_t>::format() || (info.ndim != 2 && info.ndim != 3)) {
+        throw std::invalid_argument("input must be a uint8 array of shape (height, width[, channels])");
+    }
+    if (N == 0) throw std::invalid_argument("N must be positive");
+    if (info.shape[0] < (py::ssize_t) N || info.shape[1] < (py::ssize_t) N) {
+        throw std::invalid_argument("input of shape (" + std::to_string(info.shape[0]) + ", " +
+                                    std::to_string(info.shape[1]) + ") is smaller than N = " + std::to_string(N));
+    }
+    const unsigned channels = info.ndim == 3 ? (unsigned) info.shape[2] : 1;
+    if (channels == 0) throw std::invalid_argument("input has no channels");
+    return pack_image(static_cast<const uint8_t *>(info.ptr), info.shape[0], info.shape[1], channels,
+                      info.strides[0], info.strides[1], info.ndim == 3 ? info.strides[2] : 0);
+}
+
+// 后台生成使用的线程池  第一次使用时创建 有意不释放: 退出时 Python 已经结束 工作线程不能再去获取 GIL
+static ThreadPool &async_pool() {
+    static ThreadPool *pool = new ThreadPool(0);
+    return *pool;
+}
+
+// 后台生成的取消标志  置位后正在进行的生成在下一次观察前结束
+struct CancelToken {
+    std::atomic<bool> cancelled{false};
+};
+
+// 把 make() 构造的异常交给 future  构造或交付失败时(例如 future 已经结束)丢弃  必须持有 GIL
+template<class Make>
+static void set_exception_quietly(py::object &future, Make make) {
+    try {
+        future.attr("set_exception")(make());
+    } catch (py::error_already_set &) {
+    } catch (const std::exception &) {
+    }
+}
+
+// 在后台线程池中执行 work (不持有 GIL)  完成后持有 GIL 把结果交给 concurrent.futures.Future
+// 开始前 future 已被取消则不执行  执行中 token 被取消 并且生成因此提前结束时以 CancelledError 结束
+// 取消来得太晚 生成已经完成(并且写出了 output_data)时仍然交付结果
+// with_image 为true时结果为 (image, result) 否则为 result
+static void submit_async(py::object future, std::shared_ptr<CancelToken> token,
+                         std::function<RunResult(Matrix<unsigned> *, const std::atomic<bool> *)> work,
+                         bool with_image) {
+    async_pool().submit([future, work, with_image, token]() mutable {
+        {
+            py::gil_scoped_acquire acquire;
+            bool running = false;
+            try {
+                running = future.attr("set_running_or_notify_cancel")().cast<bool>();
+            } catch (py::error_already_set &) {
+            } catch (const std::exception &) {
+            }
+            if (!running) {
+                future = py::object();
+                return;
+            }
+        }
+        Matrix<unsigned> image;
+        RunResult res{false, 0, 0, 0, 0, false};
+        bool failed = false;
+        std::string error;
+        try {
+            res = work(with_image ? &image : nullptr, &token->cancelled);
+        } catch (const std::exception &e) {
+            failed = true;
+            error = e.what();
+        } catch (...) {
+            failed = true;
+            error = "unknown error";
+        }
+
+        // future 的引用计数只能在持有 GIL 时改变  交付时的异常也在这里处理 离开前释放 future
+        // 之后销毁任务时不再触碰 Python 对象
+        py::gil_scoped_acquire acquire;
+        try {
+            if (failed) {
+                set_exception_quietly(future, [&] {
+                    return py::module::import("builtins").attr("RuntimeError")(error);
+                });
+            } else if (res.cancelled) {
+                set_exception_quietly(future, [] {
+                    return py::module::import("concurrent.futures").attr("CancelledError")();
+                });
+            } else if (with_image) {
+                future.attr("set_result")(py::make_tuple(to_array(std::move(image)), to_dict(res)));
+            } else {
+                future.attr("set_result")(to_dict(res));
+            }
+        } catch (py::error_already_set &e) {
+            set_exception_quietly(future, [&] { return e.value(); });
+        } catch (const std::exception &e) {
+            const std::string message = e.what();
+            set_exception_quietly(future, [&] { return py::module::import("builtins").attr("RuntimeError")(message); });
+        }
+        future = py::object();
+    });
+}
+
 
 //注意 pypi打包时  此处的模块名称必须与包名称一致 不然打包完成 pip 安装时编译会报错
 PYBIND11_MODULE(fastMapper_pybind, m) {
@@ -31,10 +177,204 @@ PYBIND11_MODULE(fastMapper_pybind, m) {
              int log,
              string input_data,
              string output_data,
-             string type) {
-              single_run(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type);
-              return "done";
-          });
+             string type,
+             int noise,
+             unsigned threads,
+             unsigned backtrack,
+             unsigned max_attempts,
+             uint64_t seed,
+             string propagation,
+             unsigned tile,
+             unsigned tile_overlap,
+             unsigned propagation_threads,
+             unsigned race) {
+              RunResult res;
+              {
+                  py::gil_scoped_release release;
+                  res = single_run(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type,
+                                   noise, threads, backtrack, max_attempts, seed, propagation, tile, tile_overlap,
+                                   propagation_threads, race);
+              }
+              return to_dict(res);
+          },
+          py::arg("out_height"), py::arg("out_width"), py::arg("symmetry"), py::arg("N"), py::arg("channels"),
+          py::arg("log"), py::arg("input_data"), py::arg("output_data"), py::arg("type"), py::arg("noise") = 0,
+          py::arg("threads") = 0, py::arg("backtrack") = 0, py::arg("max_attempts") = 1,
+          py::arg("seed") = 0, py::arg("propagation") = "ac4", py::arg("tile") = 0, py::arg("tile_overlap") = 2,
+          py::arg("propagation_threads") = 1, py::arg("race") = 1);
+
+    py::class_<CancelToken, std::shared_ptr<CancelToken>>(m, "CancelToken")
+            .def(py::init<>())
+            .def("cancel", [](CancelToken &token) { token.cancelled.store(true); })
+            .def_property_readonly("cancelled", [](const CancelToken &token) { return token.cancelled.load(); });
+
+    // 在后台线程池中执行 run  完成后 future 的结果为 dict (同 Model.generate)  token 用于取消正在进行的生成
+    m.def("run_async",
+          [](py::object future, std::shared_ptr<CancelToken> token, unsigned out_height, unsigned out_width,
+             unsigned symmetry, unsigned N, int channels, int log, string input_data, string output_data,
+             string type, int noise, unsigned threads, unsigned backtrack, unsigned max_attempts, uint64_t seed,
+             string propagation, unsigned tile, unsigned tile_overlap, unsigned propagation_threads,
+             unsigned race) {
+              parse_propagation(propagation);     // 参数错误在调用时抛出 ValueError 而不是交给 future
+              submit_async(future, token, [=](Matrix<unsigned> *image, const std::atomic<bool> *cancel) {
+                  std::shared_ptr<Model> model = build_model(input_data, N, symmetry, channels, threads, type, log);
+                  return generate(model, out_height, out_width, output_data, noise, log, backtrack, max_attempts,
+                                  seed, propagation, tile, tile_overlap, propagation_threads, race, image, cancel);
+              }, false);
+          },
+          py::arg("future"), py::arg("token"), py::arg("out_height"), py::arg("out_width"), py::arg("symmetry"),
+          py::arg("N"), py::arg("channels"), py::arg("log"), py::arg("input_data"), py::arg("output_data"),
+          py::arg("type"),
+          py::arg("noise") = 0, py::arg("threads") = 0, py::arg("backtrack") = 0, py::arg("max_attempts") = 1,
+          py::arg("seed") = 0, py::arg("propagation") = "ac4", py::arg("tile") = 0, py::arg("tile_overlap") = 2,
+          py::arg("propagation_threads") = 1, py::arg("race") = 1);
+
+    // 输入和输出都是 NumPy 数组  不经过文件  返回 (image, result)
+    m.def("run_array",
+          [](py::buffer input, unsigned out_height, unsigned out_width, unsigned symmetry, unsigned N, int noise,
+             unsigned threads, unsigned backtrack, unsigned max_attempts, uint64_t seed, string propagation,
+             unsigned tile, unsigned tile_overlap, unsigned propagation_threads, unsigned race, int log) {
+              Matrix<unsigned> image = from_buffer(input, N);
+              RunResult res;
+              {
+                  py::gil_scoped_release release;
+                  std::shared_ptr<Model> model = build_model(image, N, symmetry, threads, log);
+                  res = generate(model, out_height, out_width, "", noise, log, backtrack, max_attempts, seed,
+                                 propagation, tile, tile_overlap, propagation_threads, race, &image);
+              }
+              return py::make_tuple(to_array(std::move(image)), to_dict(res));
+          },
+          py::arg("input"), py::arg("out_height"), py::arg("out_width"), py::arg("symmetry"), py::arg("N"),
+          py::arg("noise") = 0, py::arg("threads") = 0, py::arg("backtrack") = 0, py::arg("max_attempts") = 1,
+          py::arg("seed") = 0, py::arg("propagation") = "ac4", py::arg("tile") = 0, py::arg("tile_overlap") = 2,
+          py::arg("propagation_threads") = 1, py::arg("race") = 1, py::arg("log") = 0);
+
+    // 构建一次  多次生成
+    py::class_<Model, std::shared_ptr<Model>>(m, "Model")
+            .def(py::init([](string input_data, unsigned N, unsigned symmetry, int channels, unsigned threads,
+                             string type, int log) {
+                     py::gil_scoped_release release;
+                     return build_model(input_data, N, symmetry, channels, threads, type, log);
+                 }),
+                 py::arg("input_data"), py::arg("N"), py::arg("symmetry"), py::arg("channels") = 3,
+                 py::arg("threads") = 0, py::arg("type") = "img", py::arg("log") = 0)
+            .def("generate",
+                 [](Model &model, unsigned out_height, unsigned out_width, string output_data, int noise, int log,
+                    unsigned backtrack, unsigned max_attempts, uint64_t seed, string propagation,
+                    unsigned tile, unsigned tile_overlap, unsigned propagation_threads,
+                    unsigned race) {
+                     RunResult res;
+                     {
+                         py::gil_scoped_release release;
+                         res = generate(model.shared_from_this(), out_height, out_width, output_data, noise, log,
+                                        backtrack, max_attempts, seed, propagation, tile, tile_overlap,
+                                        propagation_threads, race);
+                     }
+                     return to_dict(res);
+                 },
+                 py::arg("out_height"), py::arg("out_width"), py::arg("output_data"), py::arg("noise") = 0,
+                 py::arg("log") = 0, py::arg("backtrack") = 0, py::arg("max_attempts") = 1,
+                 py::arg("seed") = 0, py::arg("propagation") = "ac4", py::arg("tile") = 0,
+                 py::arg("tile_overlap") = 2, py::arg("propagation_threads") = 1,
+                 py::arg("race") = 1)
+            // 一次生成多张图  seeds 为空时由 seed 派生 count 个种子
+            // output_dir 非空时第 i 张写入 output_dir/i.png  return_images 为true时每项带有 RGB 字节 "image"
+            .def("generate_batch",
+                 [](Model &model, unsigned out_height, unsigned out_width, unsigned count,
+                    std::vector<uint64_t> seeds, string output_dir, bool return_images, unsigned threads,
+                    int noise, int log, unsigned backtrack, unsigned max_attempts, uint64_t seed,
+                    string propagation, unsigned propagation_threads) {
+                     if (seeds.empty()) seeds = batch_seeds(seed, count, max_attempts);
+                     std::vector<std::string> paths;
+                     if (!output_dir.empty()) {
+                         for (unsigned i = 0; i < seeds.size(); i++) {
+                             paths.push_back(output_dir + "/" + std::to_string(i) + ".png");
+                         }
+                     }
+                     std::vector<Matrix<unsigned>> images;
+                     std::vector<RunResult> results;
+                     {
+                         py::gil_scoped_release release;
+                         results = generate_batch(model.shared_from_this(), out_height, out_width, seeds, paths,
+                                                  return_images ? &images : nullptr, threads, noise, log, backtrack,
+                                                  max_attempts, propagation, propagation_threads);
+                     }
+                     py::list list;
+                     for (unsigned i = 0; i < results.size(); i++) {
+                         py::dict item = to_dict(results[i]);
+                         if (return_images) item["image"] = to_rgb_bytes(images[i]);
+                         list.append(item);
+                     }
+                     return list;
+                 },
+                 py::arg("out_height"), py::arg("out_width"), py::arg("count") = 0,
+                 py::arg("seeds") = std::vector<uint64_t>(), py::arg("output_dir") = "",
+                 py::arg("return_images") = true, py::arg("threads") = 0, py::arg("noise") = 0, py::arg("log") = 0,
+                 py::arg("backtrack") = 0, py::arg("max_attempts") = 1, py::arg("seed") = 0,
+                 py::arg("propagation") = "ac4", py::arg("propagation_threads") = 1)
+            .def("save",
+                 [](const Model &model, string path) {
+                     py::gil_scoped_release release;
+                     if (!model_file::save(model, path)) throw std::runtime_error("can not save model to " + path);
+                 },
+                 py::arg("path"))
+            .def_static("from_array",
+                        [](py::buffer input, unsigned N, unsigned symmetry, unsigned threads, int log) {
+                            Matrix<unsigned> image = from_buffer(input, N);
+                            py::gil_scoped_release release;
+                            return build_model(image, N, symmetry, threads, log);
+                        },
+                        py::arg("input"), py::arg("N"), py::arg("symmetry"), py::arg("threads") = 0,
+                        py::arg("log") = 0)
+            .def("generate_array",
+                 [](Model &model, unsigned out_height, unsigned out_width, int noise, int log, unsigned backtrack,
+                    unsigned max_attempts, uint64_t seed, string propagation, unsigned tile, unsigned tile_overlap,
+                    unsigned propagation_threads, unsigned race) {
+                     Matrix<unsigned> image;
+                     RunResult res;
+                     {
+                         py::gil_scoped_release release;
+                         res = generate(model.shared_from_this(), out_height, out_width, "", noise, log, backtrack,
+                                        max_attempts, seed, propagation, tile, tile_overlap, propagation_threads,
+                                        race, &image);
+                     }
+                     return py::make_tuple(to_array(std::move(image)), to_dict(res));
+                 },
+                 py::arg("out_height"), py::arg("out_width"), py::arg("noise") = 0, py::arg("log") = 0,
+                 py::arg("backtrack") = 0, py::arg("max_attempts") = 1, py::arg("seed") = 0,
+                 py::arg("propagation") = "ac4", py::arg("tile") = 0, py::arg("tile_overlap") = 2,
+                 py::arg("propagation_threads") = 1, py::arg("race") = 1)
+            // 在后台线程池中生成  完成后 future 的结果为 result dict  return_image 为true时为 (image, result)
+            .def("generate_async",
+                 [](Model &model, py::object future, std::shared_ptr<CancelToken> token, unsigned out_height,
+                    unsigned out_width, string output_data, bool return_image, int noise, int log,
+                    unsigned backtrack, unsigned max_attempts, uint64_t seed, string propagation, unsigned tile,
+                    unsigned tile_overlap, unsigned propagation_threads, unsigned race) {
+                     parse_propagation(propagation);
+                     std::shared_ptr<const Model> shared = model.shared_from_this();
+                     submit_async(future, token, [=](Matrix<unsigned> *image, const std::atomic<bool> *cancel) {
+                         return generate(shared, out_height, out_width, output_data, noise, log, backtrack,
+                                         max_attempts, seed, propagation, tile, tile_overlap, propagation_threads,
+                                         race, image, cancel);
+                     }, return_image);
+                 },
+                 py::arg("future"), py::arg("token"), py::arg("out_height"), py::arg("out_width"),
+                 py::arg("output_data") = "", py::arg("return_image") = true, py::arg("noise") = 0,
+                 py::arg("log") = 0, py::arg("backtrack") = 0,
+                 py::arg("max_attempts") = 1, py::arg("seed") = 0, py::arg("propagation") = "ac4",
+                 py::arg("tile") = 0, py::arg("tile_overlap") = 2, py::arg("propagation_threads") = 1,
+                 py::arg("race") = 1)
+            .def_static("load",
+                        [](string path, bool verify) {
+                            py::gil_scoped_release release;
+                            std::shared_ptr<Model> model = model_file::load(path, verify);
+                            if (!model) throw std::runtime_error("can not load model from " + path);
+                            return model;
+                        },
+                        py::arg("path"), py::arg("verify") = false)
+            .def_readonly("N", &Model::N)
+            .def_readonly("symmetry", &Model::symmetry)
+            .def_property_readonly("feature_size", [](const Model &model) { return model.feature_size(); });
 
 
 }
@@ -33,7 +33,7 @@ extern "C" int run(lua_State *L) {
     std::cout<<out_width<<endl;
     std::cout<<type<<endl;
 
-    res = single_run(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type);
+    res = single_run(out_height, out_width, symmetry, N, channels, log, input_data, output_data, type).success;
 
     lua_pushnumber(L, res);//将平均数压如栈，供lua获取
 
@@ -3,6 +3,9 @@
 
 #include "declare.hpp"
 #include "wfc.hpp"
+#include "simd.hpp"
+#include "threadPool.hpp"
+#include <atomic>
 #include <bitset>
 
 using namespace std;
@@ -11,18 +14,27 @@ using namespace std;
 template<class T, class ImgAbstractFeature>
 class Img : public WFC {
 public:
+    explicit Img(const Config &conf, std::shared_ptr<const Model> model = nullptr) : WFC(conf, std::move(model)) {}
+
     ImgAbstractFeature _data;
 
-    void init_input_data() {
-        init_direction();
+    // 直接使用内存中的图像作为输入 不再读取 input_data  像素低8位起依次为 R G B
+    void set_input_image(const ImgAbstractFeature &image) {
+        input_image = image;
+    }
+
+    simd::EqualFunc equal_u32 = simd::get_equal_u32();
+
+    void init_input_data(Model &model) {
+        init_direction(model);
         init_row_data();
-        init_features();
-        init_compatible();
+        init_features(model);
+        init_compatible(model);
     }
 
-    void init_direction() {
+    void init_direction(Model &model) {
 
-        _direction._direct = {{0,  1},
+        model._direction._direct = {{0,  1},
                               {1,  0},
                               {0,  -1},
                               {-1, 0},
@@ -30,11 +42,16 @@ public:
     }
 
     void init_row_data() {
+        if (!input_image.data.empty()) {
+            this->_data = input_image;
+            cout << "input img width  " << input_image.getWidth() << "  height  " << input_image.getHeight() << endl;
+            return;
+        }
         int width;
         int height;
         int num_components;
-        unsigned char *data = stbi_load(conf->input_data.c_str(), &width, &height, &num_components,
-                                        conf->channels);
+        unsigned char *data = stbi_load(ctx.conf.input_data.c_str(), &width, &height, &num_components,
+                                        ctx.conf.channels);
 
         this->_data = ImgAbstractFeature(height, width);
         for (unsigned i = 0; i < (unsigned) height; i++) {
@@ -50,129 +67,263 @@ public:
 
     // 此函数用于判断两个特征 在某个方向上的重叠部分 是否完全相等
     // 重叠部分 全都都相等 才返回true
-    bool isIntersect(const ImgAbstractFeature &feature1, const ImgAbstractFeature &feature2, unsigned directionId) noexcept {
-//        std::pair<int, int> direction = _direction._data[directionId];
-        int dx = _direction.getX(directionId);
-        int dy = _direction.getY(directionId);
+    // 按行整段比较像素  比较函数在运行时按CPU指令集(AVX2/SSE4.2/标量)选择
+    bool isIntersect(const Model &model, const ImgAbstractFeature &feature1, const ImgAbstractFeature &feature2,
+                     unsigned directionId) noexcept {
+        static_assert(sizeof(unsigned) == sizeof(uint32_t), "pixels are packed into 32 bits");
+        int dx = model._direction.getX(directionId);
+        int dy = model._direction.getY(directionId);
 
         unsigned xmin = max(dx, 0);
         unsigned xmax = min(feature2.getWidth() + dx, feature1.getWidth());
         unsigned ymin = max(dy, 0);
         unsigned ymax = min(feature2.getHeight() + dy, feature1.getWidth());
+        if (xmin >= xmax || ymin >= ymax) return true;
 
-        // 以第一个特征为比较对象 比较每个重叠的元素
-        for (unsigned y = ymin; y < ymax; y++) {
-            for (unsigned x = xmin; x < xmax; x++) {
-                // 检查值是否相同
-
-                unsigned x2 = x - dx;
-                unsigned y2 = y - dy;
+        const unsigned width = feature2.getWidth();
+        const uint32_t *data1 = feature1.data.data();
+        const uint32_t *data2 = feature2.data.data();
 
-                if (feature1.get(x + y * feature2.getWidth()) != feature2.get(x2 + y2 * feature2.getWidth())) {
-                    return false;
-                }
+        // 水平方向没有偏移时 重叠部分在内存中是连续的 整块比较
+        if (xmin == 0 && xmax == width) {
+            return equal_u32(data1 + ymin * width, data2 + (ymin - dy) * width, (ymax - ymin) * width);
+        }
 
+        // 以第一个特征为比较对象 逐行比较重叠的部分
+        for (unsigned y = ymin; y < ymax; y++) {
+            if (!equal_u32(data1 + y * width + xmin, data2 + (y - dy) * width + (xmin - dx), xmax - xmin)) {
+                return false;
             }
         }
         return true;
     }
 
-    void init_compatible() noexcept {
+    // 特征在矩形区域 [xmin, xmax) x [ymin, ymax) 内像素的哈希(FNV-1a)
+    // 两个特征的重叠部分相等时 各自重叠区域的哈希必然相等
+    uint64_t overlap_signature(const ImgAbstractFeature &fea, unsigned xmin, unsigned xmax,
+                               unsigned ymin, unsigned ymax) const noexcept {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (unsigned y = ymin; y < ymax; y++) {
+            for (unsigned x = xmin; x < xmax; x++) {
+                hash = (hash ^ fea.get(y, x)) * 0x100000001b3ULL;
+            }
+        }
+        return hash;
+    }
+
+    void init_compatible(Model &model) noexcept {
         //图案id  方向id   此图案此方向同图案的id
         // 是一个二维矩阵  居中中的每个元素为一个非定长数组
         //记录了一个特征在某一个方向上是否能进行传播
-        propagator =
+        model.propagator =
                 std::vector<std::vector<BitMap>>
-                        (feature.size(),
-                         vector<BitMap>(_direction.getMaxNumber(), BitMap(feature.size())));
-
-        long long cnt = 0;
-        for (unsigned feature1 = 0; feature1 < feature.size(); feature1++) {
-            //每个方向
-            for (unsigned directionId = 0; directionId < _direction.getMaxNumber(); directionId++) {
-                //每个方向的所有特征 注意  需要遍历所有特征 这里的特征已经不包含位置信息了
-                for (unsigned feature2 = 0; feature2 < feature.size(); feature2++) {
-
-                    BitMap &temp2 = propagator[feature1][directionId];
-
-                    //判断是否相等  相等就压入图案到传播队列
-                    if (isIntersect(feature[feature1], feature[feature2], directionId)) {
+                        (model.feature.size(),
+                         vector<BitMap>(model._direction.getMaxNumber(), BitMap(model.feature.size())));
+
+        const unsigned direction_size = model.feature.empty() ? 0 : model._direction.getMaxNumber();
+
+        // 重叠区域在第一个特征中的范围  第二个特征中的范围为其平移 (-dx, -dy)
+        std::vector<unsigned> xmin(direction_size), xmax(direction_size), ymin(direction_size), ymax(direction_size);
+
+        // 每个方向 按第二个特征重叠区域的哈希分桶  只有同一个桶里的特征才可能与第一个特征兼容
+        std::vector<std::unordered_map<uint64_t, std::vector<unsigned>>> buckets(direction_size);
+        for (unsigned directionId = 0; directionId < direction_size; directionId++) {
+            int dx = model._direction.getX(directionId);
+            int dy = model._direction.getY(directionId);
+
+            const unsigned width = model.feature[0].getWidth();
+            const unsigned height = model.feature[0].getHeight();
+            xmin[directionId] = max(dx, 0);
+            xmax[directionId] = max((int) xmin[directionId], min((int) width + dx, (int) width));
+            ymin[directionId] = max(dy, 0);
+            ymax[directionId] = max((int) ymin[directionId], min((int) height + dy, (int) height));
+
+            for (unsigned feature2 = 0; feature2 < model.feature.size(); feature2++) {
+                uint64_t signature = overlap_signature(model.feature[feature2], xmin[directionId] - dx, xmax[directionId] - dx,
+                                                       ymin[directionId] - dy, ymax[directionId] - dy);
+                buckets[directionId][signature].push_back(feature2);
+            }
+        }
 
-                        temp2.set(feature2, true);
-                        cnt++;
+        // 按第一个特征分块并行  每个任务只写 propagator[feature1]  结果与串行构建完全相同
+        std::atomic<long long> cnt(0);
+        auto build_rows = [&](unsigned begin, unsigned end) {
+            long long row_cnt = 0;
+            for (unsigned feature1 = begin; feature1 < end; feature1++) {
+                for (unsigned directionId = 0; directionId < direction_size; directionId++) {
+                    const auto &bucket_map = buckets[directionId];
+                    auto bucket = bucket_map.find(overlap_signature(model.feature[feature1], xmin[directionId], xmax[directionId],
+                                                                    ymin[directionId], ymax[directionId]));
+                    if (bucket == bucket_map.end()) continue;
+
+                    BitMap &temp2 = model.propagator[feature1][directionId];
+                    for (unsigned feature2 : bucket->second) {
+                        //哈希可能冲突 逐个像素确认重叠部分相等后  压入图案到传播队列
+                        if (isIntersect(model, model.feature[feature1], model.feature[feature2], directionId)) {
+                            temp2.set(feature2, true);
+                            row_cnt++;
+                        }
                     }
                 }
             }
+            cnt += row_cnt;
+        };
+
+        unsigned threads = ThreadPool::get_thread_number(ctx.conf.threads);
+        if (threads > 1 && model.feature.size() > 1) {
+            ThreadPool pool(std::min<unsigned>(threads, model.feature.size()));
+            pool.parallel_for(0, model.feature.size(), build_rows);
+        } else {
+            build_rows(0, model.feature.size());
         }
 
-        cout << "feature1 size  " << feature.size() << "  max direction number "
-             << _direction.getMaxNumber()
+        cout << "feature1 size  " << model.feature.size() << "  max direction number "
+             << model._direction.getMaxNumber()
              << " propagator count  " << cnt
+             << " compare kernel  " << simd::get_equal_u32_name()
+             << " threads  " << threads
              << endl;
     }
 
-    void init_features() noexcept {
-        std::unordered_map<ImgAbstractFeature, unsigned> features_id;
-        std::vector<ImgAbstractFeature> symmetries(conf->symmetry,
-                                                   ImgAbstractFeature(conf->N, conf->N));
+    // 窗口左上角为 (i, j) 的 N*N 像素与 fea 是否完全相同
+    bool is_same_window(unsigned i, unsigned j, const ImgAbstractFeature &fea) const noexcept {
+        const unsigned N = ctx.conf.N;
+        for (unsigned ki = 0; ki < N; ki++) {
+            if (!equal_u32(&this->_data.get(i + ki, j), &fea.get(ki, 0), N)) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        unsigned max_i = this->_data.getHeight() - conf->N + 1;
-        unsigned max_j = this->_data.getWidth() - conf->N + 1;
+    void copy_window(unsigned i, unsigned j, ImgAbstractFeature &fea) const noexcept {
+        const unsigned N = ctx.conf.N;
+        for (unsigned ki = 0; ki < N; ki++) {
+            std::copy(&this->_data.get(i + ki, j), &this->_data.get(i + ki, j) + N, &fea.get(ki, 0));
+        }
+    }
+
+    // 先用二维滚动哈希(Rabin-Karp)对所有 N*N 窗口去重并计数  每个窗口的哈希O(1)得到 哈希相同时才逐像素比较
+    // 再按窗口第一次出现的顺序生成对称图案  图案的顺序与频次和逐窗口插入时完全相同
+    void init_features(Model &model) noexcept {
+        const unsigned N = ctx.conf.N;
+        const unsigned height = this->_data.getHeight();
+        const unsigned width = this->_data.getWidth();
+        if (height < N || width < N) return;
+
+        const unsigned max_i = height - N + 1;
+        const unsigned max_j = width - N + 1;
+
+        // 行方向与列方向的哈希基数 以及它们的 N-1 次方  运算均在 mod 2^64 下进行
+        const uint64_t row_base = 0x9E3779B97F4A7C15ULL;
+        const uint64_t col_base = 0xC2B2AE3D27D4EB4FULL;
+        uint64_t row_pow = 1, col_pow = 1;
+        for (unsigned k = 1; k < N; k++) {
+            row_pow *= row_base;
+            col_pow *= col_base;
+        }
+
+        // row_hash[y * max_j + x] 为第 y 行从 x 开始长度为 N 的一段像素的哈希
+        std::vector<uint64_t> row_hash((size_t) height * max_j);
+        for (unsigned y = 0; y < height; y++) {
+            uint64_t hash = 0;
+            for (unsigned x = 0; x < N; x++) {
+                hash = hash * row_base + this->_data.get(y, x);
+            }
+            row_hash[(size_t) y * max_j] = hash;
+            for (unsigned x = 1; x < max_j; x++) {
+                hash = (hash - this->_data.get(y, x - 1) * row_pow) * row_base + this->_data.get(y, x + N - 1);
+                row_hash[(size_t) y * max_j + x] = hash;
+            }
+        }
 
+        // window_hash[x] 为当前行 i 上左上角为 (i, x) 的窗口的哈希  随 i 增加向下滚动
+        std::vector<uint64_t> window_hash(max_j, 0);
+        for (unsigned y = 0; y < N; y++) {
+            for (unsigned x = 0; x < max_j; x++) {
+                window_hash[x] = window_hash[x] * col_base + row_hash[(size_t) y * max_j + x];
+            }
+        }
+
+        std::unordered_map<uint64_t, std::vector<unsigned>> window_ids;  // 哈希 -> 不同窗口的编号
+        std::vector<ImgAbstractFeature> windows;                          // 去重后的窗口 按第一次出现的顺序
+        std::vector<unsigned> windows_count;                              // 每个窗口出现的次数
+
+        ImgAbstractFeature scratch(N, N);
         for (unsigned i = 0; i < max_i; i++) {
+            if (i > 0) {
+                for (unsigned x = 0; x < max_j; x++) {
+                    window_hash[x] = (window_hash[x] - row_hash[(size_t) (i - 1) * max_j + x] * col_pow) * col_base
+                                     + row_hash[(size_t) (i + N - 1) * max_j + x];
+                }
+            }
+
             for (unsigned j = 0; j < max_j; j++) {
-                symmetries[0].data = this->_data.get_sub_array(i, j, conf->N, conf->N).data;
-                //TODO 优化镜像的生成过程
-                if (1 < conf->symmetry) symmetries[1].data = symmetries[0].reflected().data;
-                if (2 < conf->symmetry) symmetries[2].data = symmetries[0].rotated().data;
-                if (3 < conf->symmetry) symmetries[3].data = symmetries[2].reflected().data;
-                if (4 < conf->symmetry) symmetries[4].data = symmetries[2].rotated().data;
-                if (5 < conf->symmetry) symmetries[5].data = symmetries[4].reflected().data;
-                if (6 < conf->symmetry) symmetries[6].data = symmetries[4].rotated().data;
-                if (7 < conf->symmetry) symmetries[7].data = symmetries[6].reflected().data;
-
-                for (unsigned k = 0; k < conf->symmetry; k++) {
-                    auto res = features_id.insert(std::make_pair(symmetries[k], feature.size()));
-                    if (!res.second) {
-                        features_frequency[res.first->second] += 1;
-                    } else {
-                        feature.push_back(symmetries[k]);
-                        features_frequency.push_back(1);
+                std::vector<unsigned> &ids = window_ids[window_hash[j]];
+                bool found = false;
+                for (unsigned id : ids) {
+                    if (is_same_window(i, j, windows[id])) {
+                        windows_count[id]++;
+                        found = true;
+                        break;
                     }
                 }
+                if (!found) {
+                    copy_window(i, j, scratch);
+                    ids.push_back(windows.size());
+                    windows.push_back(scratch);
+                    windows_count.push_back(1);
+                }
             }
         }
 
-        cout << "features size  " << feature.size() << "  features_frequency size "
-             << features_frequency.size()
+        // 对称图案写入可复用的缓冲区  只有新的图案才会复制进 feature
+        std::unordered_map<ImgAbstractFeature, unsigned> features_id;
+        std::vector<ImgAbstractFeature> symmetries(ctx.conf.symmetry, ImgAbstractFeature(N, N));
+        for (unsigned w = 0; w < windows.size(); w++) {
+            symmetries[0].data = windows[w].data;
+            if (1 < ctx.conf.symmetry) symmetries[0].reflected(symmetries[1]);
+            if (2 < ctx.conf.symmetry) symmetries[0].rotated(symmetries[2]);
+            if (3 < ctx.conf.symmetry) symmetries[2].reflected(symmetries[3]);
+            if (4 < ctx.conf.symmetry) symmetries[2].rotated(symmetries[4]);
+            if (5 < ctx.conf.symmetry) symmetries[4].reflected(symmetries[5]);
+            if (6 < ctx.conf.symmetry) symmetries[4].rotated(symmetries[6]);
+            if (7 < ctx.conf.symmetry) symmetries[6].reflected(symmetries[7]);
+
+            for (unsigned k = 0; k < ctx.conf.symmetry; k++) {
+                auto res = features_id.find(symmetries[k]);
+                if (res != features_id.end()) {
+                    model.features_frequency[res->second] += windows_count[w];
+                } else {
+                    features_id.insert(std::make_pair(symmetries[k], model.feature.size()));
+                    model.feature.push_back(symmetries[k]);
+                    model.features_frequency.push_back(windows_count[w]);
+                }
+            }
+        }
+
+        cout << "features size  " << model.feature.size() << "  features_frequency size "
+             << model.features_frequency.size()
              << endl;
     }
 
+    // 生成结果的像素  与写入文件的图像相同
+    ImgAbstractFeature get_image() {
+        return data.to_image(get_output());
+    }
+
     void show_result(const Matrix<unsigned>& mat) {
         ImgAbstractFeature res = data.to_image(mat);
         if (res.data.size() > 0) {
-            this->data.write_image_png(conf->output_data, res);
+            this->data.write_image_png(ctx.conf.output_data, res);
             cout << " finished!" << endl;
         } else {
             cout << "failed!" << endl;
         }
     };
 
-
-    bool isVaildPatternId(unsigned pId) {
-        unsigned y = pId / conf->wave_width;
-        unsigned x = pId % conf->wave_width;
-
-        if (x < 0 || x >= (int) conf->wave_width) {
-            return false;
-        }
-        if (y < 0 || y >= (int) conf->wave_height) {
-            return false;
-        }
-        return true;
-    }
-
-
+private:
+    ImgAbstractFeature input_image;
 };
 
 #endif // SRC_IMAGEMODEL_HPP
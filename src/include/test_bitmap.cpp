@@ -10,19 +10,39 @@ using namespace std;
 
 int main(int argc, char *argv[]) {
 
-    BitMap bitMap(32);
+    BitMap bitMap(130);
     bitMap.set(0,true);
 
     bitMap.set(6,false);
 
     bitMap.set(15,false);
     bitMap.set(16,true);
+    bitMap.set(64,true);
+    bitMap.set(129,true);
     cout<<bitMap<<endl;
+    assert(bitMap.markSize() == 4 && bitMap.popcount() == 4);
 
-    BitMap b2(32);
+    // 遍历所有为1的位
+    vector<unsigned> ids(bitMap.begin(), bitMap.end());
+    assert(ids == vector<unsigned>({0, 16, 64, 129}));
+    assert(bitMap.find_next_set(17) == 64);
+    assert(bitMap.find_next_set(130) == 130);
+
+    BitMap b2(130);
     b2.set(0,true);
+    b2.set(64,true);
 
     cout<<b2<<endl;
 
+    BitMap b3(bitMap);
+    b3.and_with(b2);
+    assert(b3.markSize() == 2);
+    b3.andnot_with(b2);
+    assert(!b3.any() && b3.markSize() == 0);
+
+    vector<BitMap> maps(3, BitMap(130));
+    maps.push_back(std::move(bitMap));
+    assert(maps.back().markSize() == 4);
+
     return 0;
-}
\ No newline at end of file
+}
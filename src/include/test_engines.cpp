@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <assert.h>
+
+#include <iostream>
+#include <vector>
+
+#include "../fastMapper.hpp"
+
+using namespace std;
+
+typedef vector<pair<unsigned, unsigned>> Pins;
+
+// 同样的初始删除(没有支持的图案和固定的wave)之后  两种传播得到的wave必须完全相同
+// 是否矛盾也必须相同
+void check_same_wave(const shared_ptr<const Model> &model, unsigned size, const Pins &pins, unsigned threads) {
+    Config ac4(size, size, model->symmetry, model->N, model->channels, 0, "", "", model->type, 0, 0, 0, 1, 1, "ac4",
+               0, 2, threads);
+    Config ac3(size, size, model->symmetry, model->N, model->channels, 0, "", "", model->type, 0, 0, 0, 1, 1, "ac3");
+    Img<int, AbstractFeature> a(ac4, model), b(ac3, model);
+    a.set_pins(pins);
+    b.set_pins(pins);
+    const bool ok = a.prepare(1);
+    assert(ok == b.prepare(1));
+    if (!ok) return;
+    for (unsigned wave_id = 0; wave_id < ac4.wave_size; wave_id++) {
+        for (unsigned fea_id = 0; fea_id < model->feature_size(); fea_id++) {
+            assert(a.possible(wave_id, fea_id) == b.possible(wave_id, fea_id));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *inputs[][3] = {{"../../samples/City.png", "3", "8"},
+                               {"../../samples/Cat.png",  "3", "8"},
+                               {"../../samples/Cat.png",  "4", "8"},
+                               {"../../samples/wall.png", "3", "2"}};
+    const unsigned size = 30;
+    srand(7);
+    for (auto &input : inputs) {
+        shared_ptr<const Model> model = build_model(input[0], atoi(input[1]), atoi(input[2]));
+        const unsigned wave_side = size - model->N + 1;
+
+        // 只有没有支持的图案
+        check_same_wave(model, size, Pins(), 1);
+        check_same_wave(model, size, Pins(), 4);
+
+        // 固定为一次成功生成的部分结果
+        Config conf(size, size, model->symmetry, model->N, model->channels, 0, "", "", model->type, 0, 0, 0, 30, 3);
+        Img<int, AbstractFeature> done(conf, model);
+        assert(done.run());
+        Matrix<unsigned> output = done.get_output();
+        for (unsigned round = 0; round < 10; round++) {
+            Pins pins;
+            for (unsigned i = 0; i < 5; i++) {
+                const unsigned wave_id = rand() % (wave_side * wave_side);
+                pins.emplace_back(wave_id, output.get(wave_id));
+            }
+            check_same_wave(model, size, pins, 1);
+        }
+
+        // 任意的图案  可能矛盾
+        for (unsigned round = 0; round < 20; round++) {
+            Pins pins;
+            for (unsigned i = 0; i < 3; i++) {
+                pins.emplace_back(rand() % (wave_side * wave_side), rand() % model->feature_size());
+            }
+            check_same_wave(model, size, pins, 1 + round % 2 * 3);
+        }
+        cout << input[0] << "  N " << input[1] << "  same wave" << endl;
+    }
+    return 0;
+}
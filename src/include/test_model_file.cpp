@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <assert.h>
+
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "../fastMapper.hpp"
+
+using namespace std;
+
+// 保存后再加载的模型与原模型完全相同  用两者以同一个种子生成的结果也相同
+void check_round_trip(const char *input, unsigned N, unsigned symmetry, const string &path) {
+    shared_ptr<Model> model = build_model(input, N, symmetry);
+    assert(model_file::save(*model, path));
+    shared_ptr<Model> loaded = model_file::load(path);
+    assert(loaded && model_file::load(path, true));
+
+    assert(loaded->N == model->N && loaded->symmetry == model->symmetry && loaded->type == model->type);
+    assert(loaded->feature_size() == model->feature_size());
+    const unsigned direction_size = model->_direction.getMaxNumber();
+    assert(loaded->_direction.getMaxNumber() == direction_size);
+    for (unsigned d = 0; d < direction_size; d++) {
+        assert(loaded->_direction.getX(d) == model->_direction.getX(d));
+        assert(loaded->_direction.getY(d) == model->_direction.getY(d));
+    }
+    for (unsigned fea_id = 0; fea_id < model->feature_size(); fea_id++) {
+        assert(loaded->frequency(fea_id) == model->frequency(fea_id));
+        assert(equal(model->pattern(fea_id), model->pattern(fea_id) + N * N, loaded->pattern(fea_id)));
+        for (unsigned d = 0; d < direction_size; d++) {
+            assert(loaded->compatible_size(fea_id, d) == model->compatible_size(fea_id, d));
+            assert(equal(model->narrow_propagator.begin(fea_id, d), model->narrow_propagator.end(fea_id, d),
+                         loaded->narrow_propagator.begin(fea_id, d)));
+        }
+    }
+
+    Matrix<unsigned> a, b;
+    RunResult ra = generate(model, 24, 24, "", 0, 0, 0, 10, 5, "ac4", 0, 2, 1, 1, &a);
+    RunResult rb = generate(loaded, 24, 24, "", 0, 0, 0, 10, 5, "ac4", 0, 2, 1, 1, &b);
+    assert(ra.success == rb.success && ra.seed == rb.seed && a.data == b.data);
+}
+
+int main(int argc, char *argv[]) {
+    const string path = "test_model_file.fmm";
+    check_round_trip("../../samples/Cat.png", 1, 2, path);
+    check_round_trip("../../samples/Cat.png", 2, 8, path);
+    check_round_trip("../../samples/City.png", 3, 8, path);
+    check_round_trip("../../samples/wall.png", 4, 2, path);
+
+    // 越界的 CSR 索引只在 verify 时检查
+    {
+        shared_ptr<Model> model = build_model("../../samples/City.png", 3, 8);
+        assert(model_file::save(*model, path));
+        model_file::Header header;
+        fstream file(path, ios::in | ios::out | ios::binary);
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        const uint16_t bad = (uint16_t) header.feature_size;
+        file.seekp(header.indices_offset);
+        file.write(reinterpret_cast<const char *>(&bad), sizeof(bad));
+        file.close();
+        assert(model_file::load(path));
+        assert(!model_file::load(path, true));
+    }
+
+    // 方向表损坏时总是拒绝
+    {
+        shared_ptr<Model> model = build_model("../../samples/City.png", 3, 8);
+        assert(model_file::save(*model, path));
+        model_file::Header header;
+        fstream file(path, ios::in | ios::out | ios::binary);
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        const int32_t far = 3;
+        file.seekp(header.directions_offset);
+        file.write(reinterpret_cast<const char *>(&far), sizeof(far));
+        file.close();
+        assert(!model_file::load(path));
+    }
+
+    remove(path.c_str());
+    cout << "model file round trip passed" << endl;
+    return 0;
+}
@@ -13,9 +13,27 @@ int main(int argc, char *argv[]) {
     a.add<unsigned>("N", 'N', "N", true);
     a.add<int>("channels", 'c', "c", false, 3);
     a.add<int>("log", 'l', "log", false, 1);
-    a.add<string>("input_data", 'i', "input_data", true);
+    a.add<string>("input_data", 'i', "input_data", false, "");
     a.add<string>("output_data", 'o', "output_data", true);
     a.add<string>("type", 't', "type", true);
+    a.add<int>("noise", 'n', "add tie-break noise to entropy", false, 0);
+    a.add<unsigned>("threads", 'j', "threads used to build the propagator and to generate -k outputs, 0 for all cores",
+                    false, 0);
+    a.add<unsigned>("backtrack", 'b', "max number of decisions undone on contradiction, 0 to fail at once", false,
+                    0);
+    a.add<unsigned>("max_attempts", 'a', "retry with a derived seed until success, at most this many times", false,
+                    1);
+    a.add<unsigned long long>("seed", 'r', "seed of the first attempt, 0 for a random one", false, 0);
+    a.add<string>("propagation", 'p', "propagation engine: ac4 (pattern counters) or ac3 (cell bit masks)", false,
+                  "ac4", cmdline::oneof<string>("ac4", "ac3"));
+    a.add<unsigned>("tile", '\0', "generate in tiles of this many cells per side, 0 to generate at once", false, 0);
+    a.add<unsigned>("tile_overlap", '\0', "cells each tile regenerates into finished neighbours", false, 2);
+    a.add<unsigned>("propagation_threads", '\0', "threads used by ac4 propagation, split into row bands", false, 1);
+    a.add<unsigned>("race", '\0', "run this many seeds at once and keep the first success", false, 1);
+    a.add<unsigned>("count", 'k', "number of outputs generated from one model", false, 1);
+    a.add<string>("save_model", '\0', "write the compiled model to this file", false, "");
+    a.add<string>("load_model", '\0', "load a compiled model instead of reading input_data", false, "");
+    a.add<int>("verify_model", '\0', "check every propagator index of the loaded model, for untrusted files", false, 0);
     a.parse_check(argc, argv);
 
     unsigned height = a.get<unsigned>("height");
@@ -27,9 +45,60 @@ int main(int argc, char *argv[]) {
     string input_data = a.get<std::string>("input_data");
     string output_data = a.get<std::string>("output_data");
     string type = a.get<std::string>("type");
+    int noise = a.get<int>("noise");
+    unsigned threads = a.get<unsigned>("threads");
+    unsigned backtrack = a.get<unsigned>("backtrack");
+    unsigned max_attempts = a.get<unsigned>("max_attempts");
+    uint64_t seed = a.get<unsigned long long>("seed");
+    string propagation = a.get<std::string>("propagation");
+    unsigned tile = a.get<unsigned>("tile");
+    unsigned tile_overlap = a.get<unsigned>("tile_overlap");
+    unsigned propagation_threads = a.get<unsigned>("propagation_threads");
+    unsigned race = a.get<unsigned>("race");
+    unsigned count = a.get<unsigned>("count");
 
-    single_run(height, width, symmetry, N, channels, log, input_data, output_data, type);
+    string save_path = a.get<std::string>("save_model");
+    string load_path = a.get<std::string>("load_model");
+    bool verify_model = a.get<int>("verify_model") != 0;
+
+    if (count <= 1 && save_path.empty() && load_path.empty()) {
+        RunResult res = single_run(height, width, symmetry, N, channels, log, input_data, output_data, type, noise,
+                                   threads, backtrack, max_attempts, seed, propagation, tile, tile_overlap,
+                                   propagation_threads, race);
+        return res.success ? 0 : 1;
+    }
+
+    // 只构建(或加载)一次规则集  并行生成 done_0.png done_1.png ...
+    std::shared_ptr<Model> model = load_path.empty()
+                                   ? build_model(input_data, N, symmetry, channels, threads, type, log)
+                                   : model_file::load(load_path, verify_model);
+    if (!model) return 1;
+    if (!save_path.empty() && !model_file::save(*model, save_path)) return 1;
+
+    bool res = true;
+    // 每张图都是普通生成时 交给线程池并行生成
+    if (count > 1 && tile == 0 && race <= 1) {
+        std::vector<string> paths;
+        for (unsigned i = 0; i < count; i++) {
+            paths.push_back(unit::indexed_path(output_data, i));
+        }
+        std::vector<RunResult> results = generate_batch(model, height, width, batch_seeds(seed, count, max_attempts),
+                                                        paths, nullptr, threads, noise, log, backtrack, max_attempts,
+                                                        propagation, propagation_threads);
+        for (const RunResult &result : results) {
+            res = result.success && res;
+        }
+        return res ? 0 : 1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        string path = count > 1 ? unit::indexed_path(output_data, i) : output_data;
+        // 指定了种子时 每张图使用互不重叠的一段派生种子
+        uint64_t output_seed = seed ? unit::derive_seed(seed, i * max_attempts) : 0;
+        res = generate(model, height, width, path, noise, log, backtrack, max_attempts, output_seed,
+                       propagation, tile, tile_overlap, propagation_threads,
+                       race).success && res;
+    }
 //    cin.get();
-    return 0;
+    return res ? 0 : 1;
 }
 
@@ -0,0 +1,278 @@
+#ifndef SRC_MODELFILE_HPP
+#define SRC_MODELFILE_HPP
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define FASTMAPPER_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "declare.hpp"
+
+// 编译后规则集的二进制文件格式
+// 文件头之后依次是 方向 / 图案像素 / 图案频率 / CSR offsets / CSR indices 五段 每段按64字节对齐
+// 各段的布局与内存中的数组完全一致  加载时整个文件 mmap 进来 只检查文件头 然后直接指向各段 不做任何解析
+// 默认只检查文件头 方向表和 CSR 的两端  加载时间与文件大小无关
+// CSR 中每个索引和图案频率的检查要扫描整个文件 只在 verify 时进行  来源不可信的文件应当打开 verify
+// 文件按写入机器的字节序保存  字节序不同时拒绝加载
+namespace model_file {
+
+    const char magic[8] = {'F', 'M', 'M', 'O', 'D', 'E', 'L', '\0'};
+    const uint32_t version = 1;
+    const uint32_t byte_order = 0x01020304;
+    const uint64_t alignment = 64;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order;
+        uint32_t N;
+        uint32_t symmetry;
+        uint32_t channels;
+        uint32_t feature_size;
+        uint32_t direction_size;
+        uint32_t index_bytes;       // CSR 索引的字节数  图案少于65536时为2 否则为4
+        uint64_t index_size;        // CSR 索引的个数
+        uint64_t file_size;
+        uint64_t directions_offset; // 每个方向两个 int32 (x, y)
+        uint64_t patterns_offset;   // feature_size * N * N 个 uint32 像素
+        uint64_t frequencies_offset;// feature_size 个 uint32
+        uint64_t offsets_offset;    // feature_size * direction_size + 1 个 uint64
+        uint64_t indices_offset;    // index_size 个 uint16 或 uint32
+        char type[16];
+    };
+
+    inline uint64_t align(uint64_t offset) noexcept {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    inline bool write_section(std::ofstream &out, uint64_t &pos, uint64_t offset, const void *data, uint64_t bytes) {
+        static const char zeros[alignment] = {0};
+        out.write(zeros, offset - pos);
+        if (bytes) out.write(static_cast<const char *>(data), bytes);
+        pos = offset + bytes;
+        return (bool) out;
+    }
+
+    // 把编译后的模型写入文件  成功返回true
+    inline bool save(const Model &model, const std::string &path) {
+        const uint32_t fea_size = model.feature_size();
+        const uint32_t direction_size = model._direction.getMaxNumber();
+        const size_t row_size = (size_t) fea_size * direction_size;
+        const bool narrow = model.is_narrow();
+        const uint64_t *offsets = narrow ? model.narrow_propagator.offset_data() : model.wide_propagator.offset_data();
+        if (fea_size == 0 || offsets == nullptr) {
+            std::cerr << "save model failed: model is not compiled" << std::endl;
+            return false;
+        }
+
+        std::vector<int32_t> directions;
+        for (unsigned i = 0; i < direction_size; i++) {
+            directions.push_back(model._direction.getX(i));
+            directions.push_back(model._direction.getY(i));
+        }
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic, sizeof(magic));
+        header.version = version;
+        header.byte_order = byte_order;
+        header.N = model.N;
+        header.symmetry = model.symmetry;
+        header.channels = model.channels;
+        header.feature_size = fea_size;
+        header.direction_size = direction_size;
+        header.index_bytes = narrow ? sizeof(uint16_t) : sizeof(uint32_t);
+        header.index_size = offsets[row_size];
+        strncpy(header.type, model.type.c_str(), sizeof(header.type) - 1);
+
+        const uint64_t pattern_bytes = (uint64_t) fea_size * model.N * model.N * sizeof(uint32_t);
+        header.directions_offset = align(sizeof(Header));
+        header.patterns_offset = align(header.directions_offset + directions.size() * sizeof(int32_t));
+        header.frequencies_offset = align(header.patterns_offset + pattern_bytes);
+        header.offsets_offset = align(header.frequencies_offset + fea_size * sizeof(uint32_t));
+        header.indices_offset = align(header.offsets_offset + (row_size + 1) * sizeof(uint64_t));
+        header.file_size = header.indices_offset + header.index_size * header.index_bytes;
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            std::cerr << "save model failed: can not open " << path << std::endl;
+            return false;
+        }
+        const void *indices = narrow ? (const void *) model.narrow_propagator.index_data()
+                                     : (const void *) model.wide_propagator.index_data();
+        uint64_t pos = 0;
+        bool ok = write_section(out, pos, 0, &header, sizeof(header))
+                  && write_section(out, pos, header.directions_offset, directions.data(),
+                                   directions.size() * sizeof(int32_t))
+                  && write_section(out, pos, header.patterns_offset, model.pattern(0), pattern_bytes)
+                  && write_section(out, pos, header.frequencies_offset, model.frequencies(),
+                                   fea_size * sizeof(uint32_t))
+                  && write_section(out, pos, header.offsets_offset, offsets, (row_size + 1) * sizeof(uint64_t))
+                  && write_section(out, pos, header.indices_offset, indices, header.index_size * header.index_bytes);
+        if (!ok) {
+            std::cerr << "save model failed: can not write " << path << std::endl;
+        }
+        return ok;
+    }
+
+    // count 个 size 字节的元素是否放得进 limit 字节  先除后比较 避免乘法溢出
+    inline bool fits(uint64_t count, uint64_t size, uint64_t limit) noexcept {
+        return count <= limit / size;
+    }
+
+    // 检查文件头和各段的范围  各段的内容由 check_directions 和 check_content 检查
+    inline bool check(const Header &header, uint64_t file_size) {
+        if (memcmp(header.magic, magic, sizeof(magic)) != 0) return false;
+        if (header.version != version || header.byte_order != byte_order) return false;
+        if (header.file_size != file_size || header.feature_size == 0 || header.N == 0) return false;
+        if (header.index_bytes != (header.feature_size < 65536 ? sizeof(uint16_t) : sizeof(uint32_t))) return false;
+
+        const uint64_t row_size = (uint64_t) header.feature_size * header.direction_size;
+        const uint64_t pattern_rows = (uint64_t) header.feature_size * header.N;
+        if (!fits(pattern_rows, header.N, file_size)) return false;
+        const uint64_t counts[5][2] = {
+                {(uint64_t) header.direction_size * 2, sizeof(int32_t)},
+                {pattern_rows * header.N,              sizeof(uint32_t)},
+                {header.feature_size,                  sizeof(uint32_t)},
+                {row_size + 1,                         sizeof(uint64_t)},
+                {header.index_size,                    header.index_bytes},
+        };
+        const uint64_t offsets[5] = {header.directions_offset, header.patterns_offset, header.frequencies_offset,
+                                     header.offsets_offset, header.indices_offset};
+        for (unsigned i = 0; i < 5; i++) {
+            if (offsets[i] % alignment != 0 || offsets[i] < sizeof(Header) || offsets[i] > file_size) return false;
+            if (!fits(counts[i][0], counts[i][1], file_size - offsets[i])) return false;
+        }
+        return true;
+    }
+
+    // 方向成对相反: 第 i 个的反方向是第 i + direction_size / 2 个 与 DirectionSet::get_opposite_direction 一致
+    // 位移不为0 且不超过 max(N - 1, 1)  N 为1时图案只有一个像素 相邻的位移仍然是1
+    inline bool check_directions(const Header &header, const int32_t *directions) {
+        const uint32_t size = header.direction_size;
+        const int64_t limit = header.N > 1 ? header.N - 1 : 1;
+        if (size == 0 || size % 2 != 0) return false;
+        for (uint32_t i = 0; i < size; i++) {
+            const int64_t x = directions[2 * i], y = directions[2 * i + 1];
+            const uint32_t opposite = (size / 2 + i) % size;
+            if ((x == 0 && y == 0) || std::abs(x) > limit || std::abs(y) > limit) return false;
+            if (directions[2 * opposite] != -x || directions[2 * opposite + 1] != -y) return false;
+        }
+        return true;
+    }
+
+    // CSR 的 offsets 从0开始单调不减 止于 index_size  每个索引都小于图案数
+    // 传播时直接用这些值访问兼容计数和wave 不再检查
+    template<class Index>
+    inline bool check_propagator(const Header &header, const uint64_t *offsets, const Index *indices) {
+        const uint64_t row_size = (uint64_t) header.feature_size * header.direction_size;
+        for (uint64_t row = 0; row < row_size; row++) {
+            if (offsets[row] > offsets[row + 1]) return false;
+        }
+        for (uint64_t i = 0; i < header.index_size; i++) {
+            if (indices[i] >= header.feature_size) return false;
+        }
+        return true;
+    }
+
+    // 各段的内容  一次线性扫描 远小于重新构建的代价 但与文件大小成正比  文件损坏时在这里拒绝 而不是在生成时越界
+    inline bool check_content(const Header &header, const char *base) {
+        const uint32_t *frequencies = reinterpret_cast<const uint32_t *>(base + header.frequencies_offset);
+        for (uint32_t i = 0; i < header.feature_size; i++) {
+            if (frequencies[i] == 0) return false;
+        }
+        const uint64_t *offsets = reinterpret_cast<const uint64_t *>(base + header.offsets_offset);
+        if (header.index_bytes == sizeof(uint16_t)) {
+            return check_propagator(header, offsets, reinterpret_cast<const uint16_t *>(base + header.indices_offset));
+        }
+        return check_propagator(header, offsets, reinterpret_cast<const uint32_t *>(base + header.indices_offset));
+    }
+
+    // 文件内容所在的内存  mmap 的映射或者读入的缓冲区  析构时释放
+    inline std::shared_ptr<const void> map_file(const std::string &path, uint64_t &size) {
+#ifdef FASTMAPPER_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Header)) {
+            close(fd);
+            return nullptr;
+        }
+        size = st.st_size;
+        void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) return nullptr;
+        const size_t length = size;
+        return std::shared_ptr<const void>(addr, [length](const void *p) { munmap(const_cast<void *>(p), length); });
+#else
+        // 没有 mmap 的平台整体读入一块按8字节对齐的内存
+        std::ifstream in(path, std::ios::binary | std::ios::ate);
+        if (!in) return nullptr;
+        size = in.tellg();
+        if (size < sizeof(Header)) return nullptr;
+        std::shared_ptr<std::vector<uint64_t>> buffer = std::make_shared<std::vector<uint64_t>>((size + 7) / 8);
+        in.seekg(0);
+        if (!in.read(reinterpret_cast<char *>(buffer->data()), size)) return nullptr;
+        return std::shared_ptr<const void>(buffer, buffer->data());
+#endif
+    }
+
+    // 从文件加载模型  失败返回空指针  verify 为true时检查全部内容
+    inline std::shared_ptr<Model> load(const std::string &path, bool verify = false) {
+        uint64_t size = 0;
+        std::shared_ptr<const void> storage = map_file(path, size);
+        if (!storage) {
+            std::cerr << "load model failed: can not read " << path << std::endl;
+            return nullptr;
+        }
+        const char *base = static_cast<const char *>(storage.get());
+        const Header &header = *reinterpret_cast<const Header *>(base);
+        if (!check(header, size)) {
+            std::cerr << "load model failed: " << path << " is not a valid model file" << std::endl;
+            return nullptr;
+        }
+
+        const uint64_t row_size = (uint64_t) header.feature_size * header.direction_size;
+        const uint64_t *offsets = reinterpret_cast<const uint64_t *>(base + header.offsets_offset);
+        if (!check_directions(header, reinterpret_cast<const int32_t *>(base + header.directions_offset))
+            || offsets[0] != 0 || offsets[row_size] != header.index_size
+            || (verify && !check_content(header, base))) {
+            std::cerr << "load model failed: " << path << " is corrupted" << std::endl;
+            return nullptr;
+        }
+
+        std::string type(header.type, strnlen(header.type, sizeof(header.type)));
+        std::shared_ptr<Model> model = std::make_shared<Model>(header.N, header.symmetry, header.channels, type);
+        const int32_t *directions = reinterpret_cast<const int32_t *>(base + header.directions_offset);
+        model->_direction._direct.clear();
+        for (unsigned i = 0; i < header.direction_size; i++) {
+            model->_direction._direct.emplace_back(directions[2 * i], directions[2 * i + 1]);
+        }
+        if (header.index_bytes == sizeof(uint16_t)) {
+            model->narrow_propagator.attach(header.direction_size, row_size, offsets,
+                                            reinterpret_cast<const uint16_t *>(base + header.indices_offset));
+        } else {
+            model->wide_propagator.attach(header.direction_size, row_size, offsets,
+                                          reinterpret_cast<const uint32_t *>(base + header.indices_offset));
+        }
+        model->attach(storage, header.feature_size,
+                      reinterpret_cast<const uint32_t *>(base + header.patterns_offset),
+                      reinterpret_cast<const uint32_t *>(base + header.frequencies_offset));
+        return model;
+    }
+}
+
+#endif // SRC_MODELFILE_HPP
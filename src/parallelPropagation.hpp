@@ -0,0 +1,334 @@
+#ifndef SRC_PARALLELPROPAGATION_HPP
+#define SRC_PARALLELPROPAGATION_HPP
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <future>
+
+#include "wave.hpp"
+#include "threadPool.hpp"
+
+// 单生产者单消费者的无锁环形队列  容量为2的幂
+// 满时 push 返回false 由生产者自己暂存后再试  不会阻塞
+template<class T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : buffer(capacity), mask(capacity - 1), head(0), tail(0) {
+        assert((capacity & mask) == 0);
+    }
+
+    bool push(const T &value) noexcept {
+        const size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == buffer.size()) return false;
+        buffer[t & mask] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &value) noexcept {
+        const size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        value = buffer[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // 只能在没有线程使用队列时调用
+    void clear() noexcept {
+        head.store(0);
+        tail.store(0);
+    }
+
+private:
+    std::vector<T> buffer;
+    const size_t mask;
+    std::atomic<size_t> head;
+    char padding[64];   // head 和 tail 分别由两个线程写  放在不同的缓存行
+    std::atomic<size_t> tail;
+};
+
+// AC-4 计数传播  可以按区域并行
+// 输出按行分成若干条带 每个线程拥有一条  wave的删除只由拥有它的线程执行(owner computes)
+// 只有一个线程时只有一条 所有删除都在调用线程上处理
+// 条带的高度不小于 N-1  相邻的wave最远只跨到上下相邻的条带 每对相邻条带之间各有一个方向的无锁队列
+//
+// 兼容计数 (n, f, d) 只会因为 n 在方向 d 反方向上的那个wave的删除而减少  所以每个计数只有一个线程写
+// 跨条带时 由源wave的拥有者直接减少边界另一侧的计数  减到0时把 (n, f) 交给 n 的拥有者删除
+// 计数是各自独立的内存位置 不需要原子操作  线程之间共享的只有队列和结束计数
+//
+// 传播过程中wave本身只读  删除先记在 removed 掩码中  全部结束后按wave编号顺序一次用 Wave::remove 合并
+// 传播只在计数减到0时删除  所以要求开始前wave中剩下的每个图案 在每个有邻居的方向上计数都不为0 或者已经等待传播
+// 计数从0开始的图案不满足这一点  WFC 在每次尝试开始时先删掉它们 (WFC::ban_unsupported)
+// 满足这一条件时 没有矛盾的传播结果是剩余图案中最大的弧相容子集  与传播顺序无关  合并的顺序也固定 熵和日志的写入顺序都相同
+// 有矛盾时 是否出现矛盾同样与顺序无关 删除全部丢弃  所以结果与线程数(包括1)和线程调度都无关
+class ParallelPropagation {
+public:
+    explicit ParallelPropagation(Context *ctx) : ctx(ctx), contradiction(false), outstanding(0) {}
+
+    // 每次尝试开始时调用  threads 为传播使用的线程数(包括调用线程)
+    void init(const Wave &wave, unsigned threads) {
+        width = ctx->conf.wave_width;
+        row_words = wave.row_word_size();
+        removed.resize((size_t) ctx->conf.wave_size * row_words);
+        removed_count.assign(ctx->conf.wave_size, 0);
+
+        directions.clear();
+        for (unsigned i = 0; i < ctx->model->_direction.getMaxNumber(); i++) {
+            directions.push_back(ctx->model->_direction.getDirect(i));
+        }
+
+        // 条带不能比 N-1 更矮  否则相邻的wave会跨过一整条
+        const unsigned height = ctx->conf.wave_height;
+        const unsigned reach = std::max(ctx->conf.N - 1, 1u);
+        const unsigned regions = std::max(1u, std::min(threads, height / reach));
+        row_owner.resize(height);
+        for (unsigned y = 0; y < height; y++) {
+            row_owner[y] = (unsigned) ((uint64_t) y * regions / height);
+        }
+
+        workers.clear();
+        for (unsigned i = 0; i < regions; i++) {
+            workers.emplace_back(new Worker(i));
+        }
+        // queues[2 * i] 从第 i 条发往上一条  queues[2 * i + 1] 发往下一条
+        queues.clear();
+        for (unsigned i = 0; i < 2 * regions; i++) {
+            queues.emplace_back(new SpscQueue<Message>(queue_capacity));
+        }
+        if (regions > 1 && (!pool || pool->size() != regions - 1)) {
+            pool.reset(new ThreadPool(regions - 1));
+        }
+    }
+
+    template<class Count>
+    void propagate(Wave &wave, CompatibleCount<Count> &count, const SparsePropagator<Count> &sparse) {
+        Pass<Count> pass{this, &wave, &count, &sparse};
+        contradiction.store(false);
+
+        // 先在调用线程上不分区地传播  传播范围小时不值得唤醒其它线程
+        Worker &first = *workers[0];
+        while (!ctx->propagating.empty()) {
+            first.stack.push_back(ctx->propagating.top());
+            ctx->propagating.pop();
+        }
+        for (unsigned processed = 0; !first.stack.empty() && !contradiction.load(std::memory_order_relaxed);
+             processed++) {
+            if (processed == serial_limit && workers.size() > 1) {
+                run_parallel(pass);
+                break;
+            }
+            const Ban ban = first.stack.back();
+            first.stack.pop_back();
+            pass.process(first, std::get<0>(ban), std::get<1>(ban), true);
+        }
+        merge(wave, count);
+    }
+
+private:
+    typedef std::tuple<unsigned, unsigned> Ban;    // (wave_id, fea_id)
+
+    struct Message {
+        unsigned wave_id;
+        unsigned fea_id;
+    };
+
+    struct Worker {
+        explicit Worker(unsigned id) : id(id) {}
+
+        unsigned id;
+        std::vector<Ban> stack;                 // 本条带中待传播的删除
+        std::vector<unsigned> touched;          // 本次传播中有删除的wave
+        std::vector<uint32_t> journal;          // 本线程对兼容计数的自减
+        std::vector<std::pair<unsigned, Message>> overflow; // 队列满时暂存 (目标条带, 消息)
+    };
+
+    static const size_t queue_capacity = 1u << 12;
+    static const unsigned serial_limit = 1u << 12;  // 调用线程单独处理的删除数  超过后分给各条带
+
+    Context *ctx;
+    unsigned width = 0;
+    unsigned row_words = 0;
+    std::vector<std::pair<int, int>> directions;
+    std::vector<unsigned> row_owner;
+
+    unit::AlignedArray<uint64_t> removed;   // 本次传播中删除的图案  与wave的位行布局相同
+    std::vector<unsigned> removed_count;    // 每个wave在 removed 中的图案数
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<SpscQueue<Message>>> queues;
+    std::unique_ptr<ThreadPool> pool;
+
+    std::atomic<bool> contradiction;
+    // 正在工作的线程数加上已发出但还没处理完的消息数  为0时传播结束
+    std::atomic<long> outstanding;
+
+    // 一次传播中各线程共用的参数
+    template<class Count>
+    struct Pass {
+        ParallelPropagation *self;
+        Wave *wave;
+        CompatibleCount<Count> *count;
+        const SparsePropagator<Count> *sparse;
+
+        bool possible(unsigned wave_id, unsigned fea_id) const noexcept {
+            const uint64_t bit = uint64_t(1) << (fea_id & 63);
+            return wave->get(wave_id, fea_id)
+                   && !(self->removed[(size_t) wave_id * self->row_words + (fea_id >> 6)] & bit);
+        }
+
+        // 删除本条带中的一个图案  只由拥有该wave的线程调用
+        void mark(Worker &worker, unsigned wave_id, unsigned fea_id) noexcept {
+            if (!possible(wave_id, fea_id)) return;
+            self->removed[(size_t) wave_id * self->row_words + (fea_id >> 6)] |= uint64_t(1) << (fea_id & 63);
+            if (self->removed_count[wave_id]++ == 0) worker.touched.push_back(wave_id);
+            worker.stack.push_back(Ban(wave_id, fea_id));
+            if (self->removed_count[wave_id] == wave->get_wave_frequency(wave_id)) {
+                self->contradiction.store(true, std::memory_order_relaxed);
+            }
+        }
+
+        // 传播 wave_id 上 fea_id 的删除  all_local 为true时不区分条带
+        void process(Worker &worker, unsigned wave_id, unsigned fea_id, bool all_local) noexcept {
+            const int x = wave_id % self->width;
+            const int y = wave_id / self->width;
+            for (unsigned directionId = 0; directionId < self->directions.size(); directionId++) {
+                const int next_x = x + self->directions[directionId].first;
+                const int next_y = y + self->directions[directionId].second;
+                if (next_x < 0 || next_x >= (int) self->width || next_y < 0
+                    || next_y >= (int) self->row_owner.size()) {
+                    continue;
+                }
+                const unsigned wave_next = next_y * self->width + next_x;
+                const unsigned owner = self->row_owner[next_y];
+                const Count *end = sparse->end(fea_id, directionId);
+
+                if (all_local || owner == worker.id) {
+                    for (const Count *it = sparse->begin(fea_id, directionId); it != end; ++it) {
+                        if (!possible(wave_next, *it)) continue;
+                        if (count->decrement(wave_next, *it, directionId, worker.journal) == 0) {
+                            mark(worker, wave_next, *it);
+                        }
+                    }
+                } else {
+                    // 另一条带的wave只读不到 不能跳过已删除的图案  计数最多减到0一次 重复的删除由拥有者忽略
+                    for (const Count *it = sparse->begin(fea_id, directionId); it != end; ++it) {
+                        if (count->decrement(wave_next, *it, directionId, worker.journal) == 0) {
+                            self->send(worker, owner, Message{wave_next, *it});
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    SpscQueue<Message> &queue(unsigned from, unsigned to) noexcept {
+        return *queues[2 * from + (to > from ? 1 : 0)];
+    }
+
+    void send(Worker &worker, unsigned target, const Message &message) noexcept {
+        outstanding.fetch_add(1);
+        if (!worker.overflow.empty() || !queue(worker.id, target).push(message)) {
+            worker.overflow.emplace_back(target, message);
+        }
+    }
+
+    template<class Count>
+    void run_parallel(Pass<Count> &pass) {
+        // 调用线程剩下的删除交给各自的条带
+        std::vector<Ban> rest;
+        rest.swap(workers[0]->stack);
+        for (const Ban &ban : rest) {
+            workers[row_owner[std::get<0>(ban) / width]]->stack.push_back(ban);
+        }
+
+        outstanding.store(workers.size());
+        std::vector<std::future<void>> results;
+        for (unsigned i = 1; i < workers.size(); i++) {
+            results.push_back(pool->submit([this, &pass, i] { work(pass, *workers[i]); }));
+        }
+        work(pass, *workers[0]);
+        for (std::future<void> &res : results) {
+            res.get();
+        }
+
+        // 矛盾时提前结束 未处理的消息直接丢弃
+        for (std::unique_ptr<SpscQueue<Message>> &q : queues) q->clear();
+        for (std::unique_ptr<Worker> &worker : workers) {
+            worker->stack.clear();
+            worker->overflow.clear();
+        }
+    }
+
+    template<class Count>
+    void work(Pass<Count> &pass, Worker &worker) {
+        bool busy = true;
+        const unsigned id = worker.id;
+        while (!contradiction.load(std::memory_order_relaxed)) {
+            // 接收相邻条带交来的删除
+            Message message;
+            for (unsigned from = id > 0 ? id - 1 : id + 1; from <= id + 1 && from < workers.size(); from += 2) {
+                while (queue(from, id).pop(message)) {
+                    if (!busy) {
+                        outstanding.fetch_add(1);
+                        busy = true;
+                    }
+                    pass.mark(worker, message.wave_id, message.fea_id);
+                    outstanding.fetch_sub(1);
+                }
+            }
+
+            size_t sent = 0;
+            while (sent < worker.overflow.size()
+                   && queue(id, worker.overflow[sent].first).push(worker.overflow[sent].second)) {
+                sent++;
+            }
+            worker.overflow.erase(worker.overflow.begin(), worker.overflow.begin() + sent);
+
+            if (!worker.stack.empty()) {
+                // 每处理一小批就检查一次队列  避免相邻条带的队列积满
+                for (unsigned i = 0; i < 64 && !worker.stack.empty(); i++) {
+                    const Ban ban = worker.stack.back();
+                    worker.stack.pop_back();
+                    pass.process(worker, std::get<0>(ban), std::get<1>(ban), false);
+                }
+                continue;
+            }
+            if (!worker.overflow.empty()) continue;
+            if (busy) {
+                busy = false;
+                outstanding.fetch_sub(1);
+            }
+            if (outstanding.load() == 0) return;
+            std::this_thread::yield();
+        }
+    }
+
+    // 把各条带记下的删除按wave编号的顺序写入wave  每个wave只计算一次熵
+    // 有矛盾时各线程停下的位置与调度有关  删除全部丢弃 wave保持传播前的状态 只标记矛盾
+    // 兼容计数的自减总是记入日志 回溯时一起撤销
+    template<class Count>
+    void merge(Wave &wave, CompatibleCount<Count> &count) {
+        const bool failed = contradiction.load();
+        std::vector<unsigned> touched;
+        for (std::unique_ptr<Worker> &worker : workers) {
+            touched.insert(touched.end(), worker->touched.begin(), worker->touched.end());
+            worker->touched.clear();
+            count.append_journal(worker->journal);
+            worker->journal.clear();
+        }
+        if (!failed) std::sort(touched.begin(), touched.end());
+        for (unsigned wave_id : touched) {
+            uint64_t *mask = removed.data() + (size_t) wave_id * row_words;
+            if (!failed) wave.remove(wave_id, mask);
+            std::fill(mask, mask + row_words, 0);
+            removed_count[wave_id] = 0;
+        }
+        if (failed) wave.set_contradiction();
+        workers[0]->stack.clear();
+    }
+};
+
+#endif // SRC_PARALLELPROPAGATION_HPP
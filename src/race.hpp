@@ -0,0 +1,101 @@
+#ifndef SRC_RACE_HPP
+#define SRC_RACE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "wfc.hpp"
+#include "threadPool.hpp"
+
+// 多个种子同时生成 取最先成功的一个
+// 所有线程共用同一个只读的规则集  每个线程有自己的 wave 和兼容计数
+// 第 i 个线程的种子为 derive_seed(seed, i * max_attempts)  所以第0个线程与不竞争时的生成完全相同
+// 一个线程成功后其它线程收到取消 在下一次观察前结束
+template<class Generator>
+class Race {
+public:
+    Race(const Config &conf, std::shared_ptr<const Model> model) : conf(conf), model(std::move(model)) {}
+
+    // 外部的取消  等待时检查 取消后通知所有线程结束
+    void set_cancel(const std::atomic<bool> *cancel) noexcept {
+        this->cancel = cancel;
+    }
+
+    bool run() {
+        const unsigned racers = std::max(conf.race, 1u);
+        const uint64_t base_seed = conf.seed ? conf.seed : unit::random_seed();
+        std::atomic<bool> finished(false);
+        std::atomic<int> winner(-1);
+
+        std::vector<std::unique_ptr<Generator>> generators;
+        for (unsigned i = 0; i < racers; i++) {
+            Config racer_conf(conf.out_height, conf.out_width, conf.symmetry, conf.N, conf.channels, 0, "", "",
+                              conf.type, conf.noise, 0, conf.backtrack, conf.max_attempts,
+                              unit::derive_seed(base_seed, i * conf.max_attempts), propagation_name(conf.propagation),
+                              0, 0, conf.propagation_threads);
+            generators.emplace_back(new Generator(racer_conf, model));
+            generators.back()->set_cancel(&finished);
+        }
+
+        {
+            ThreadPool pool(racers);
+            std::vector<std::future<void>> results;
+            for (unsigned i = 0; i < racers; i++) {
+                results.push_back(pool.submit([&generators, &finished, &winner, i] {
+                    if (!generators[i]->run()) return;
+                    int expected = -1;
+                    if (winner.compare_exchange_strong(expected, (int) i)) finished.store(true);
+                }));
+            }
+            for (std::future<void> &res : results) {
+                while (cancel && res.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready) {
+                    if (cancel->load()) finished.store(true);
+                }
+                res.get();
+            }
+        }
+
+        // 没有成功的线程时 统计和输出都取第0个线程的  只有外部取消会让没有获胜者的线程提前结束
+        const unsigned chosen = winner.load() >= 0 ? winner.load() : 0;
+        result = generators[chosen]->get_result();
+        if (winner.load() < 0) {
+            for (const std::unique_ptr<Generator> &generator : generators) {
+                result.cancelled = result.cancelled || generator->get_result().cancelled;
+            }
+        }
+        chosen_generator = std::move(generators[chosen]);
+        if (conf.log) {
+            if (winner.load() >= 0) {
+                std::cout << "racer " << chosen << " of " << racers << " won  seed " << result.seed << std::endl;
+            } else {
+                std::cout << "all " << racers << " racers failed" << std::endl;
+            }
+        }
+        if (!conf.output_data.empty() && !result.cancelled) {
+            Generator writer(conf, model);
+            writer.show_result(chosen_generator->get_output());
+        }
+        return result.success;
+    }
+
+    RunResult get_result() const noexcept {
+        return result;
+    }
+
+    // 获胜者的像素  都失败时为第0个线程的
+    Matrix<unsigned> get_image() {
+        return chosen_generator->get_image();
+    }
+
+private:
+    Config conf;
+    std::shared_ptr<const Model> model;
+    RunResult result{false, 0, 0, 0, 0, false};
+    std::unique_ptr<Generator> chosen_generator;
+    const std::atomic<bool> *cancel = nullptr;
+};
+
+#endif // SRC_RACE_HPP
@@ -0,0 +1,80 @@
+#ifndef SRC_SIMD_HPP
+#define SRC_SIMD_HPP
+
+#include <cstdint>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FASTMAPPER_SIMD_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+// 32位像素数组的比较  运行时根据CPU支持的指令集选择 AVX2 / SSE4.2 / 标量实现  三者结果完全一致
+namespace simd {
+
+    typedef bool (*EqualFunc)(const uint32_t *a, const uint32_t *b, unsigned n);
+
+    inline bool equal_u32_scalar(const uint32_t *a, const uint32_t *b, unsigned n) noexcept {
+        for (unsigned i = 0; i < n; i++) {
+            if (a[i] != b[i]) return false;
+        }
+        return true;
+    }
+
+#ifdef FASTMAPPER_SIMD_DISPATCH
+
+    __attribute__((target("sse4.2")))
+    inline bool equal_u32_sse42(const uint32_t *a, const uint32_t *b, unsigned n) noexcept {
+        unsigned i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xFFFF) return false;
+        }
+        return equal_u32_scalar(a + i, b + i, n - i);
+    }
+
+    __attribute__((target("avx2")))
+    inline bool equal_u32_avx2(const uint32_t *a, const uint32_t *b, unsigned n) noexcept {
+        unsigned i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+            if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(va, vb)) != -1) return false;
+        }
+        if (i + 4 <= n) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(va, vb)) != 0xFFFF) return false;
+            i += 4;
+        }
+        return equal_u32_scalar(a + i, b + i, n - i);
+    }
+
+#endif
+
+    inline EqualFunc select_equal_u32() noexcept {
+#ifdef FASTMAPPER_SIMD_DISPATCH
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return equal_u32_avx2;
+        if (__builtin_cpu_supports("sse4.2")) return equal_u32_sse42;
+#endif
+        return equal_u32_scalar;
+    }
+
+    // 第一次调用时检测CPU  之后直接使用选中的实现
+    inline EqualFunc get_equal_u32() noexcept {
+        static const EqualFunc func = select_equal_u32();
+        return func;
+    }
+
+    inline const char *get_equal_u32_name() noexcept {
+#ifdef FASTMAPPER_SIMD_DISPATCH
+        EqualFunc func = get_equal_u32();
+        if (func == equal_u32_avx2) return "avx2";
+        if (func == equal_u32_sse42) return "sse4.2";
+#endif
+        return "scalar";
+    }
+}
+
+#endif // SRC_SIMD_HPP
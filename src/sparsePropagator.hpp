@@ -0,0 +1,111 @@
+#ifndef SRC_SPARSEPROPAGATOR_HPP
+#define SRC_SPARSEPROPAGATOR_HPP
+
+#include <vector>
+#include <cstddef>
+#include <cassert>
+#include <cstdint>
+
+#include "bitMap.hpp"
+
+// 压缩稀疏行(CSR)形式的传播表
+// propagator[fea_id][direction] 中为1的图案id 按 (fea_id, direction) 的顺序连续存放在 indices 中
+// offsets[fea_id * direction_size + direction] 为该行的起点  传播时只遍历可兼容的图案
+// 数据可以由 build 生成并自己持有  也可以通过 attach 直接指向外部内存(例如 mmap 的模型文件)
+template<class Index>
+class SparsePropagator {
+public:
+    SparsePropagator() : direction_size(0), row_size(0), offsets_view(nullptr), indices_view(nullptr) {}
+
+    // 视图指向自己的 vector  复制后会指向原对象的数据
+    SparsePropagator(const SparsePropagator &) = delete;
+
+    SparsePropagator &operator=(const SparsePropagator &) = delete;
+
+    void build(const std::vector<std::vector<BitMap>> &propagator) {
+        direction_size = propagator.empty() ? 0 : propagator[0].size();
+        offsets.assign(1, 0);
+        indices.clear();
+
+        size_t total = 0;
+        for (unsigned fea_id = 0; fea_id < propagator.size(); fea_id++) {
+            for (unsigned direction = 0; direction < direction_size; direction++) {
+                total += propagator[fea_id][direction].markSize();
+            }
+        }
+        offsets.reserve(propagator.size() * direction_size + 1);
+        indices.reserve(total);
+
+        for (unsigned fea_id = 0; fea_id < propagator.size(); fea_id++) {
+            for (unsigned direction = 0; direction < direction_size; direction++) {
+                for (unsigned fea_id_2 : propagator[fea_id][direction]) {
+                    indices.push_back(static_cast<Index>(fea_id_2));
+                }
+                offsets.push_back(indices.size());
+            }
+        }
+        row_size = offsets.size() - 1;
+        offsets_view = offsets.data();
+        indices_view = indices.data();
+    }
+
+    // 使用外部的数据  offsets 有 row_size + 1 项  外部内存的生命周期由调用者保证
+    void attach(unsigned direction_size, size_t row_size, const uint64_t *offsets, const Index *indices) {
+        clear();
+        this->direction_size = direction_size;
+        this->row_size = row_size;
+        offsets_view = offsets;
+        indices_view = indices;
+    }
+
+    void clear() {
+        offsets.clear();
+        indices.clear();
+        row_size = 0;
+        offsets_view = nullptr;
+        indices_view = nullptr;
+    }
+
+    bool empty() const noexcept {
+        return offsets_view == nullptr;
+    }
+
+    const Index *begin(unsigned fea_id, unsigned direction) const noexcept {
+        return indices_view + offsets_view[fea_id * direction_size + direction];
+    }
+
+    const Index *end(unsigned fea_id, unsigned direction) const noexcept {
+        return indices_view + offsets_view[fea_id * direction_size + direction + 1];
+    }
+
+    size_t size(unsigned fea_id, unsigned direction) const noexcept {
+        return end(fea_id, direction) - begin(fea_id, direction);
+    }
+
+    // 以下用于把CSR数据整体写入模型文件
+    size_t get_row_size() const noexcept {
+        return row_size;
+    }
+
+    const uint64_t *offset_data() const noexcept {
+        return offsets_view;
+    }
+
+    size_t index_size() const noexcept {
+        return empty() ? 0 : offsets_view[row_size];
+    }
+
+    const Index *index_data() const noexcept {
+        return indices_view;
+    }
+
+private:
+    unsigned direction_size;
+    size_t row_size;                // 行数 = 图案数 * 方向数
+    std::vector<uint64_t> offsets;  // 固定为64位 与模型文件中的布局一致
+    std::vector<Index> indices;
+    const uint64_t *offsets_view;
+    const Index *indices_view;
+};
+
+#endif // SRC_SPARSEPROPAGATOR_HPP
@@ -0,0 +1,103 @@
+#ifndef SRC_THREADPOOL_HPP
+#define SRC_THREADPOOL_HPP
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <algorithm>
+
+// 固定线程数的线程池  任务按提交顺序执行
+class ThreadPool {
+public:
+    // threads 为0时使用机器的硬件线程数
+    explicit ThreadPool(unsigned threads = 0) : stop(false) {
+        threads = get_thread_number(threads);
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    static unsigned get_thread_number(unsigned threads) {
+        if (threads > 0) return threads;
+        unsigned hardware = std::thread::hardware_concurrency();
+        return hardware > 0 ? hardware : 1;
+    }
+
+    unsigned size() const noexcept {
+        return workers.size();
+    }
+
+    template<class F>
+    auto submit(F func) -> std::future<decltype(func())> {
+        typedef decltype(func()) Result;
+        std::shared_ptr<std::packaged_task<Result()>> task =
+                std::make_shared<std::packaged_task<Result()>>(std::move(func));
+        std::future<Result> res = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push([task] { (*task)(); });
+        }
+        condition.notify_one();
+        return res;
+    }
+
+    // 把 [begin, end) 分成若干连续的块并行执行 func(block_begin, block_end)  全部完成后返回
+    void parallel_for(unsigned begin, unsigned end, const std::function<void(unsigned, unsigned)> &func) {
+        if (begin >= end) return;
+        const unsigned total = end - begin;
+        const unsigned blocks = std::min(total, size() * 4);
+        const unsigned block_size = (total + blocks - 1) / blocks;
+
+        std::vector<std::future<void>> results;
+        for (unsigned i = begin; i < end; i += block_size) {
+            unsigned block_end = std::min(end, i + block_size);
+            results.push_back(submit([&func, i, block_end] { func(i, block_end); }));
+        }
+        for (std::future<void> &res : results) {
+            res.get();
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stop;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [this] { return stop || !tasks.empty(); });
+                if (stop && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+
+#endif // SRC_THREADPOOL_HPP
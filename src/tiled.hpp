@@ -0,0 +1,121 @@
+#ifndef SRC_TILED_HPP
+#define SRC_TILED_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "wfc.hpp"
+
+// 分块生成很大的输出  按行优先的顺序一块一块地生成 每块只为自己的区域分配 wave 和兼容计数
+// 每块向左上方已完成的区域多重新生成 tile_overlap 宽的一条 用来消除接缝
+// 区域外 N-1 宽的一圈里已完成的wave被固定为已有的图案 作为这一块的边界条件  未完成的只参与传播 结果丢弃
+// 生成的内存只与块的大小有关  最终的图案编号和图像仍然是整张图的大小
+template<class Generator>
+class Tiled {
+public:
+    Tiled(const Config &conf, std::shared_ptr<const Model> model) : conf(conf), model(std::move(model)) {}
+
+    // 传给每一块的生成  取消后当前块失败 不再继续 也不写出结果
+    void set_cancel(const std::atomic<bool> *cancel) noexcept {
+        this->cancel = cancel;
+    }
+
+    bool run() {
+        const unsigned height = conf.wave_height;
+        const unsigned width = conf.wave_width;
+        const unsigned tile = std::max(conf.tile, 1u);
+        const unsigned overlap = std::min(conf.tile_overlap, tile);
+        const unsigned reach = conf.N - 1;
+        const uint64_t base_seed = conf.seed ? conf.seed : unit::random_seed();
+
+        output = Matrix<unsigned>(height, width);
+        std::vector<char> done((size_t) height * width, 0);
+        result = RunResult{true, base_seed, 0, 0, 0, false};
+
+        unsigned k = 0;
+        for (unsigned ty = 0; ty < height; ty += tile) {
+            for (unsigned tx = 0; tx < width; tx += tile, k++) {
+                // 本块负责的区域 [y0, y1) x [x0, x1)  以及加上边界一圈后实际生成的区域 [gy0, gy1) x [gx0, gx1)
+                const unsigned y0 = ty > overlap ? ty - overlap : 0, y1 = std::min(height, ty + tile);
+                const unsigned x0 = tx > overlap ? tx - overlap : 0, x1 = std::min(width, tx + tile);
+                const unsigned gy0 = y0 > reach ? y0 - reach : 0, gy1 = std::min(height, y1 + reach);
+                const unsigned gx0 = x0 > reach ? x0 - reach : 0, gx1 = std::min(width, x1 + reach);
+                const unsigned gh = gy1 - gy0, gw = gx1 - gx0;
+
+                std::vector<std::pair<unsigned, unsigned>> pins;
+                for (unsigned y = gy0; y < gy1; y++) {
+                    for (unsigned x = gx0; x < gx1; x++) {
+                        const bool inside = y0 <= y && y < y1 && x0 <= x && x < x1;
+                        if (!inside && done[(size_t) y * width + x]) {
+                            pins.emplace_back((y - gy0) * gw + (x - gx0), output.get(y, x));
+                        }
+                    }
+                }
+
+                Config tile_conf(gh + reach, gw + reach, conf.symmetry, conf.N, conf.channels, 0, "", "",
+                                 conf.type, conf.noise, 0, conf.backtrack, conf.max_attempts,
+                                 unit::derive_seed(base_seed, k * conf.max_attempts),
+                                 propagation_name(conf.propagation), 0, 0, conf.propagation_threads);
+                Generator generator(tile_conf, model);
+                generator.set_pins(std::move(pins));
+                generator.set_cancel(cancel);
+                const bool tile_success = generator.run();
+
+                const RunResult tile_result = generator.get_result();
+                result.attempts += tile_result.attempts;
+                result.contradictions += tile_result.contradictions;
+                result.backtracks += tile_result.backtracks;
+                if (conf.log) {
+                    std::cout << "tile " << k << "  [" << y0 << ", " << y1 << ") x [" << x0 << ", " << x1 << ")  "
+                              << (tile_success ? "done" : "failed") << std::endl;
+                }
+                if (!tile_success) {
+                    result.success = false;
+                    result.cancelled = tile_result.cancelled;
+                    if (!result.cancelled) write_output();
+                    return false;
+                }
+
+                const Matrix<unsigned> tile_output = generator.get_output();
+                for (unsigned y = y0; y < y1; y++) {
+                    for (unsigned x = x0; x < x1; x++) {
+                        output.get(y, x) = tile_output.get(y - gy0, x - gx0);
+                        done[(size_t) y * width + x] = 1;
+                    }
+                }
+            }
+        }
+        write_output();
+        return true;
+    }
+
+    // 所有块的统计之和  seed 为第一块的种子 用它和相同的参数可以复现整张图
+    RunResult get_result() const noexcept {
+        return result;
+    }
+
+    // 整张图的像素  与写入文件的图像相同
+    Matrix<unsigned> get_image() {
+        Generator writer(conf, model);
+        return writer.data.to_image(output);
+    }
+
+private:
+    Config conf;
+    std::shared_ptr<const Model> model;
+    RunResult result{false, 0, 0, 0, 0, false};
+    Matrix<unsigned> output;    // 整张图每个wave的图案
+    const std::atomic<bool> *cancel = nullptr;
+
+    // 整张图只在最后写一次  生成失败时未完成的部分使用第0个图案
+    void write_output() {
+        if (conf.output_data.empty()) return;
+        Generator writer(conf, model);
+        writer.show_result(output);
+    }
+};
+
+#endif // SRC_TILED_HPP
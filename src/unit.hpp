@@ -9,6 +9,17 @@
 #include <cmath>
 #include <cassert>
 #include <unordered_map>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <cstdint>
+#include <ctime>
+#include <chrono>
+#include <random>
+
+#ifdef _MSC_VER
+#include <malloc.h>
+#endif
 
 namespace unit {
 #ifndef M_PI
@@ -31,6 +42,17 @@ namespace unit {
     }
 
 
+    // 在扩展名前插入序号  ../output/done.png -> ../output/done_3.png
+    std::string indexed_path(const std::string &path, unsigned index) {
+        std::string::size_type dot = path.find_last_of('.');
+        std::string::size_type slash = path.find_last_of("/\\");
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            return path + "_" + std::to_string(index);
+        }
+        return path.substr(0, dot) + "_" + std::to_string(index) + path.substr(dot);
+    }
+
+
     float get_angle(float x1, float y1, float x2, float y2, float x3, float y3) {
         float theta = atan2(x1 - x3, y1 - y3) - atan2(x2 - x3, y2 - y3);
         if (theta > M_PI)
@@ -43,14 +65,18 @@ namespace unit {
     }
 
     //获取 p * log(p)
-    std::vector<float> get_plogp(const std::vector<unsigned> &distribution) noexcept {
-        std::vector<float> plogp(distribution.size(), 0);
-        for (unsigned i = 0; i < distribution.size(); i++) {
+    std::vector<float> get_plogp(const unsigned *distribution, unsigned size) noexcept {
+        std::vector<float> plogp(size, 0);
+        for (unsigned i = 0; i < size; i++) {
             plogp[i] = distribution[i] * log(distribution[i]);
         }
         return plogp;
     }
 
+    std::vector<float> get_plogp(const std::vector<unsigned> &distribution) noexcept {
+        return get_plogp(distribution.data(), distribution.size());
+    }
+
 
     float get_half_min(const std::vector<unsigned> &v) noexcept {
         float half_min = std::numeric_limits<float>::infinity();
@@ -60,15 +86,161 @@ namespace unit {
         return half_min;
     }
 
+    // 不指定种子时使用  同一秒内多次运行也会得到不同的种子
+    uint64_t random_seed() {
+        uint64_t seed = (uint64_t) std::random_device()() << 32;
+        seed ^= (uint64_t) std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        seed ^= (uint64_t) time(NULL);
+        return seed ? seed : 1;
+    }
+
+    // 第 attempt 次尝试使用的种子  第0次就是 seed 本身
+    uint64_t derive_seed(uint64_t seed, unsigned attempt) {
+        return seed + attempt * 0x9E3779B97F4A7C15ull;
+    }
+
+    // xoshiro256** 伪随机数生成器  种子用 splitmix64 展开为256位状态
+    // 每次生成持有自己的实例  相同的种子得到相同的序列 不同线程之间互不影响
+    class Random {
+    public:
+        explicit Random(uint64_t seed = 1) {
+            this->seed(seed);
+        }
+
+        void seed(uint64_t seed) noexcept {
+            for (uint64_t &word : state) {
+                word = splitmix64(seed);
+            }
+        }
+
+        uint64_t next() noexcept {
+            const uint64_t result = rotl(state[1] * 5, 7) * 9;
+            const uint64_t t = state[1] << 17;
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3] = rotl(state[3], 45);
+            return result;
+        }
+
+        // [0, bound) 上的整数  用高32位乘法代替取模 (Lemire)
+        uint32_t next_below(uint32_t bound) noexcept {
+            return (uint32_t) (((next() >> 32) * bound) >> 32);
+        }
+
+        // [0, 1) 上均匀分布  取高24位 正好填满 float 的尾数
+        float next_float() noexcept {
+            return (next() >> 40) * (1.0f / 16777216.0f);
+        }
+
+    private:
+        uint64_t state[4];
+
+        static uint64_t rotl(uint64_t x, int k) noexcept {
+            return (x << k) | (x >> (64 - k));
+        }
+
+        static uint64_t splitmix64(uint64_t &x) noexcept {
+            uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            return z ^ (z >> 31);
+        }
+    };
+
+    // [min, max) 上均匀分布的随机数
     template<class T1, class T2>
-    float getRand(T1 min, T2 max) {
+    float getRand(Random &random, T1 min, T2 max) {
         assert(min <= max);
         float _min(min);
         float _max(max);
 
-        return _min + (_max - _min) * rand() / static_cast<float>(RAND_MAX);
+        return _min + (_max - _min) * random.next_float();
     }
 
+    // 按缓存行(64字节)对齐的定长数组  只用于平凡类型(整数 浮点)
+    template<class T, size_t Align = 64>
+    class AlignedArray {
+    public:
+        AlignedArray() : _data(nullptr), _size(0) {}
+
+        explicit AlignedArray(size_t size, T value = T()) : _data(nullptr), _size(0) {
+            resize(size, value);
+        }
+
+        AlignedArray(const AlignedArray &src) : _data(nullptr), _size(0) {
+            allocate(src._size);
+            if (_size) memcpy(_data, src._data, _size * sizeof(T));
+        }
+
+        AlignedArray(AlignedArray &&src) noexcept : _data(src._data), _size(src._size) {
+            src._data = nullptr;
+            src._size = 0;
+        }
+
+        AlignedArray &operator=(AlignedArray src) noexcept {
+            std::swap(_data, src._data);
+            std::swap(_size, src._size);
+            return *this;
+        }
+
+        ~AlignedArray() {
+            release();
+        }
+
+        void resize(size_t size, T value = T()) {
+            allocate(size);
+            std::fill(_data, _data + _size, value);
+        }
+
+        T &operator[](size_t i) noexcept {
+            assert(i < _size);
+            return _data[i];
+        }
+
+        const T &operator[](size_t i) const noexcept {
+            assert(i < _size);
+            return _data[i];
+        }
+
+        T *data() noexcept { return _data; }
+
+        const T *data() const noexcept { return _data; }
+
+        size_t size() const noexcept { return _size; }
+
+    private:
+        T *_data;
+        size_t _size;
+
+        void allocate(size_t size) {
+            release();
+            if (size == 0) return;
+            void *p = nullptr;
+#ifdef _MSC_VER
+            p = _aligned_malloc(size * sizeof(T), Align);
+#else
+            if (posix_memalign(&p, Align, size * sizeof(T)) != 0) p = nullptr;
+#endif
+            if (!p) throw std::bad_alloc();
+            _data = static_cast<T *>(p);
+            _size = size;
+        }
+
+        void release() noexcept {
+            if (!_data) return;
+#ifdef _MSC_VER
+            _aligned_free(_data);
+#else
+            free(_data);
+#endif
+            _data = nullptr;
+            _size = 0;
+        }
+    };
+
 
 }
 #endif //SRC_UNTI_HPP
@@ -4,31 +4,43 @@
 #include <iostream>
 #include <limits>
 #include <vector>
-#include <unordered_map>
+#include <cstdint>
 
 #include "data.hpp"
+#include "entropyHeap.hpp"
 
 class Wave {
 public:
+    explicit Wave(Context *ctx) : ctx(ctx), journaling(false) {}
+
     void init_wave(){
-        wave_size = conf->wave_size;
-        plogp = unit::get_plogp(features_frequency);
+        wave_size = ctx->conf.wave_size;
+        plogp = unit::get_plogp(ctx->model->frequencies(), ctx->model->feature_size());
+        contradiction = false;
+        journal.clear();
         init_map();
         init_entropy();
+        init_noise();
     }
 
-    long long getKey(unsigned wave_id, unsigned fea_id) const  {
-        return wave_id * conf->wave_size + fea_id;
+    // 每个wave占一行 row_words 个64位字  第fea_id位表示该图案是否仍然可能
+    bool get(unsigned wave_id, unsigned fea_id) const {
+        const uint64_t word = wave_bits[(size_t) wave_id * row_words + (fea_id >> 6)];
+        return (word >> (fea_id & 63)) & 1;
     }
 
-     bool get(unsigned wave_id, unsigned fea_id) const {
-       auto key = getKey(wave_id, fea_id);
-        auto iter = wave_map.find(key);
-        if (iter != wave_map.end()) {
-            return iter->second;
-        } else {
-            return false;
-        }
+    // 该wave的可能图案  row_word_size() 个64位字
+    const uint64_t *row(unsigned wave_id) const noexcept {
+        return wave_bits.data() + (size_t) wave_id * row_words;
+    }
+
+    unsigned row_word_size() const noexcept {
+        return row_words;
+    }
+
+    // 从 from 开始(包含)该wave下一个可能的图案  没有则返回 feature.size()
+    unsigned next_feature(unsigned wave_id, unsigned from) const noexcept {
+        return bits::find_next_set(wave_bits.data() + (size_t) wave_id * row_words, ctx->model->feature_size(), from);
     }
 
     /*
@@ -40,8 +52,16 @@ public:
         bool old_value = this->get(wave_id, fea_id);
         if (old_value == status) return;
 
+        //回溯时需要恢复的旧值
+        if (journaling) {
+            journal.push_back(BanRecord{wave_id, fea_id, entropy_sum_vec[wave_id], frequency_sum_vec[wave_id],
+                                        entropy_vec[wave_id]});
+        }
+
         //设置状态
-        wave_map[getKey(wave_id, fea_id)] = status;
+        uint64_t &word = wave_bits[(size_t) wave_id * row_words + (fea_id >> 6)];
+        const uint64_t mask = uint64_t(1) << (fea_id & 63);
+        word = status ? (word | mask) : (word & ~mask);
 
         //减少该wave  熵的总合
         entropy_sum_vec[wave_id] -= plogp[fea_id];
@@ -50,89 +70,305 @@ public:
         float &x = frequency_sum_vec[wave_id];
 
         //自减少对应的featture频率
-        x -= features_frequency[fea_id];
+        x -= ctx->model->frequency(fea_id);
+        weight_sum_vec[wave_id] -= ctx->model->frequency(fea_id);
 
         frequency_num_vec[wave_id]--;
 
+        //没有任何可能的图案了 产生矛盾 此wave的熵已无意义
+        if (frequency_num_vec[wave_id] == 0) {
+            contradiction = true;
+            entropy_heap.remove(wave_id);
+            return;
+        }
+
         /*
          * entropy_vec[wave_id] = log(该位置所有图案的频率) - (该位置wave的熵 也是该位置所有可能feature的熵之和) / 该位置所有图案的频率 ;
          *
          */
         entropy_vec[wave_id] = 1*log(x) - entropy_sum_vec[wave_id] / x;
+
+        //更新最小熵堆  只剩一个图案(已确定)或没有图案(矛盾)的wave不再参与观察
+        if (frequency_num_vec[wave_id] > 1) {
+            entropy_heap.update(wave_id, get_entropy(wave_id));
+        } else {
+            entropy_heap.remove(wave_id);
+        }
     }
 
-    inline unsigned get_wave_frequency(unsigned wave_id) {
-        return frequency_num_vec[wave_id];
+    // 观察时把wave确定为 fea_id  其余可能的图案按字整体清除 并按图案顺序压入传播栈
+    // 结果与逐个 ban 相同  但熵只在最后计算一次
+    void collapse(unsigned wave_id, unsigned fea_id) noexcept {
+        assert(this->get(wave_id, fea_id));
+        uint64_t *row = wave_bits.data() + (size_t) wave_id * row_words;
+        const unsigned words = bits::word_count(ctx->model->feature_size());
+        const unsigned chosen_word = fea_id >> 6;
+        const uint64_t chosen_mask = uint64_t(1) << (fea_id & 63);
+
+        //回溯时每个被清除的图案都恢复到 collapse 之前的状态
+        const BanRecord record{wave_id, fea_id, entropy_sum_vec[wave_id], frequency_sum_vec[wave_id],
+                               entropy_vec[wave_id]};
+
+        for (unsigned w = 0; w < words; w++) {
+            uint64_t removed = w == chosen_word ? row[w] & ~chosen_mask : row[w];
+            if (!removed) continue;
+            row[w] ^= removed;
+            for (; removed; removed &= removed - 1) {
+                const unsigned removed_id = (w << 6) + bits::lowest(removed);
+                ctx->propagating.push(std::tuple<unsigned, unsigned>(wave_id, removed_id));
+                if (journaling) {
+                    journal.push_back(record);
+                    journal.back().fea_id = removed_id;
+                }
+            }
+        }
+
+        // 只剩一个图案  熵为 log(f) - f*log(f)/f = 0
+        const unsigned frequency = ctx->model->frequency(fea_id);
+        entropy_sum_vec[wave_id] = plogp[fea_id];
+        frequency_sum_vec[wave_id] = frequency;
+        weight_sum_vec[wave_id] = frequency;
+        frequency_num_vec[wave_id] = 1;
+        entropy_vec[wave_id] = 0;
+        entropy_heap.remove(wave_id);
     }
 
-    inline unsigned get_entropy(unsigned wave_id) {
-        return entropy_vec[wave_id];
+    // 一次清除 mask 中的所有图案  mask 中已经不可能的图案忽略  熵在最后计算一次
+    // 返回实际清除的图案数
+    unsigned remove(unsigned wave_id, const uint64_t *mask) noexcept {
+        uint64_t *row = wave_bits.data() + (size_t) wave_id * row_words;
+        const unsigned words = bits::word_count(ctx->model->feature_size());
+        const BanRecord record{wave_id, 0, entropy_sum_vec[wave_id], frequency_sum_vec[wave_id],
+                               entropy_vec[wave_id]};
+
+        unsigned removed_size = 0;
+        for (unsigned w = 0; w < words; w++) {
+            uint64_t removed = row[w] & mask[w];
+            if (!removed) continue;
+            row[w] ^= removed;
+            for (; removed; removed &= removed - 1) {
+                const unsigned fea_id = (w << 6) + bits::lowest(removed);
+                const unsigned frequency = ctx->model->frequency(fea_id);
+                entropy_sum_vec[wave_id] -= plogp[fea_id];
+                frequency_sum_vec[wave_id] -= frequency;
+                weight_sum_vec[wave_id] -= frequency;
+                removed_size++;
+                if (journaling) {
+                    journal.push_back(record);
+                    journal.back().fea_id = fea_id;
+                }
+            }
+        }
+        if (removed_size == 0) return 0;
+
+        frequency_num_vec[wave_id] -= removed_size;
+        if (frequency_num_vec[wave_id] == 0) {
+            contradiction = true;
+            entropy_heap.remove(wave_id);
+            return removed_size;
+        }
+
+        const float x = frequency_sum_vec[wave_id];
+        entropy_vec[wave_id] = log(x) - entropy_sum_vec[wave_id] / x;
+        if (frequency_num_vec[wave_id] > 1) {
+            entropy_heap.update(wave_id, get_entropy(wave_id));
+        } else {
+            entropy_heap.remove(wave_id);
+        }
+        return removed_size;
     }
 
-    const unsigned get_features_frequency(unsigned wave_id, unsigned i) const {
-        return this->get(wave_id, i) ? features_frequency[i] : 0;
+    void set_journaling(bool status) noexcept {
+        journaling = status;
     }
 
-    const unsigned get_wave_all_frequency(unsigned wave_id) const {
-        // 遍历所有特征  根据分布结构选择一个元素
-        unsigned s = 0;
-        for (unsigned k = 0; k < feature.size(); k++) {
-            // 如果图案存在 就取频次 否则就是0  注意 这里是取频次 不是频率
-            s += this->get_features_frequency(wave_id, k);
+    size_t journal_size() const noexcept {
+        return journal.size();
+    }
+
+    // 按相反顺序撤销日志中 size 之后的所有ban  恢复后的熵与ban之前完全相同
+    // 只会回溯到没有矛盾的状态
+    void rollback(size_t size) noexcept {
+        while (journal.size() > size) {
+            const BanRecord &record = journal.back();
+            const unsigned wave_id = record.wave_id;
+            wave_bits[(size_t) wave_id * row_words + (record.fea_id >> 6)] |= uint64_t(1) << (record.fea_id & 63);
+            entropy_sum_vec[wave_id] = record.entropy_sum;
+            frequency_sum_vec[wave_id] = record.frequency_sum;
+            entropy_vec[wave_id] = record.entropy;
+            frequency_num_vec[wave_id]++;
+            weight_sum_vec[wave_id] += ctx->model->frequency(record.fea_id);
+            if (frequency_num_vec[wave_id] > 1) {
+                entropy_heap.update(wave_id, get_entropy(wave_id));
+            } else {
+                entropy_heap.remove(wave_id);
+            }
+            journal.pop_back();
         }
-        return s;
+        contradiction = false;
+    }
+
+    // 不会再回溯到 size 之前  这部分日志不再需要
+    void discard_journal(size_t size) {
+        journal.discard_before(size);
     }
 
+    // 传播发现了矛盾但没有把删除写入wave时调用  回溯时和日志一起清除
+    void set_contradiction() noexcept {
+        contradiction = true;
+    }
 
-    // 随机数逐步减小 小于0时中断,即随机选取，选中的概率和元素频率一致
-    const unsigned get_chosen_value_by_random(unsigned wave_id, unsigned sum) const {
-        unsigned chosen_fea_id = 0;
-        float random_value = unit::getRand(0, sum);  //随机生成一个noise
+    // 是否有wave已经没有任何可能的图案
+    bool is_contradiction() const noexcept {
+        return contradiction;
+    }
 
-        while (chosen_fea_id < feature.size() && random_value > 0) {
-            random_value -= this->get_features_frequency(wave_id, chosen_fea_id);
-            chosen_fea_id++;
-        }
+    // 所有wave都已确定 没有可观察的wave了
+    bool is_all_decided() const noexcept {
+        return entropy_heap.empty();
+    }
+
+    // 熵最小的未确定wave  调用前需保证 is_all_decided() 为false
+    unsigned get_min_entropy_wave() const noexcept {
+        return entropy_heap.top();
+    }
+
+    inline unsigned get_wave_frequency(unsigned wave_id) {
+        return frequency_num_vec[wave_id];
+    }
+
+    // 熵加上该wave固定的噪声  噪声小于任意两个图案造成的熵差 只影响熵相同时的选择
+    inline float get_entropy(unsigned wave_id) const {
+        return noise_vec.empty() ? entropy_vec[wave_id] : entropy_vec[wave_id] + noise_vec[wave_id];
+    }
 
-        if (chosen_fea_id != 0) chosen_fea_id--;
+    // 该wave所有可能图案的频次之和  在 ban 中增量维护
+    unsigned get_wave_all_frequency(unsigned wave_id) const {
+        return weight_sum_vec[wave_id];
+    }
+
+    // 按频次加权随机选取该wave的一个可能图案  选中的概率和图案频次成正比
+    // 随机数在 [0, 频次和) 中取整数 逐个减去为1的位对应的频次  整字为0时直接跳过
+    unsigned get_chosen_value_by_random(unsigned wave_id) {
+        const unsigned fea_size = ctx->model->feature_size();
+        const uint64_t *row = wave_bits.data() + (size_t) wave_id * row_words;
+        unsigned random_value = ctx->random.next_below(weight_sum_vec[wave_id]);
+        unsigned chosen_fea_id = fea_size;
+
+        for (unsigned w = 0, words = bits::word_count(fea_size); w < words; w++) {
+            for (uint64_t word = row[w]; word; word &= word - 1) {
+                chosen_fea_id = (w << 6) + bits::lowest(word);
+                const unsigned frequency = ctx->model->frequency(chosen_fea_id);
+                if (random_value < frequency) return chosen_fea_id;
+                random_value -= frequency;
+            }
+        }
         return chosen_fea_id;
     }
 
 
 
 private:
+    Context *ctx;
+
     unsigned wave_size;
 
     std::vector<float> plogp;
 
-    unordered_map<long long, bool> wave_map;
+    unsigned row_words; // 每个wave一行所占的64位字数  超过一个缓存行时按缓存行补齐
+
+    unit::AlignedArray<uint64_t> wave_bits; // 所有wave的可能图案  一个图案一位
 
     std::vector<float> entropy_sum_vec; // The sum of p'(fea) * log(p'(fea)).
     std::vector<float> frequency_sum_vec;       // The features_frequency_sum of p'(fea).
     std::vector<unsigned> frequency_num_vec; // The number of feature present
+    std::vector<unsigned> weight_sum_vec;    // 可能图案的频次之和 用整数保存 抽样时不受浮点误差影响
     std::vector<float> entropy_vec;       // The entropy of the cell
+    std::vector<float> noise_vec;         // 每个wave的熵噪声 未开启噪声时为空
+
+    bool contradiction; // 是否产生了矛盾
+
+    // 一次ban之前该wave的状态
+    struct BanRecord {
+        unsigned wave_id;
+        unsigned fea_id;
+        float entropy_sum;
+        float frequency_sum;
+        float entropy;
+    };
+
+    bool journaling;                // 是否记录ban  只在回溯模式下开启
+    Journal<BanRecord> journal;
+
+    EntropyHeap entropy_heap; // 未确定wave按熵排列的最小堆
 
     void init_entropy() {
         float entropy_sum = 0;
         float frequency_sum = 0;
+        unsigned weight_sum = 0;
 
-        for (unsigned i = 0; i < feature.size(); i++) {
+        for (unsigned i = 0; i < ctx->model->feature_size(); i++) {
             entropy_sum += plogp[i];        // 所有熵的和
-            frequency_sum += features_frequency[i];      //频率和
+            frequency_sum += ctx->model->frequency(i);      //频率和
+            weight_sum += ctx->model->frequency(i);
         }
 
         entropy_sum_vec = std::vector<float>(wave_size, entropy_sum);
         frequency_sum_vec = std::vector<float>(wave_size, frequency_sum);
-        frequency_num_vec = std::vector<unsigned>(wave_size, feature.size());
+        frequency_num_vec = std::vector<unsigned>(wave_size, ctx->model->feature_size());
+        weight_sum_vec = std::vector<unsigned>(wave_size, weight_sum);
         //最核心的数据   记录每个wave对应的熵
         entropy_vec = std::vector<float>(wave_size, log(frequency_sum) - entropy_sum / frequency_sum);
+
     }
 
-    void init_map() {
-        for (unsigned i = 0; i < conf->wave_size; i++) {
-            for (unsigned j = 0; j < feature.size(); j++) {
-                wave_map[getKey(i, j)] = true;
+    // 噪声幅度取 |p*log(p)|/2 的最小值 (p为图案的归一化频率)  每个wave的噪声在初始化时随机生成一次
+    void init_noise() {
+        noise_vec.clear();
+        if (ctx->conf.noise && ctx->model->feature_size() > 1) {
+            float frequency_sum = 0;
+            for (unsigned i = 0; i < ctx->model->feature_size(); i++) {
+                frequency_sum += ctx->model->frequency(i);
+            }
+            float noise_max = std::numeric_limits<float>::infinity();
+            for (unsigned i = 0; i < ctx->model->feature_size(); i++) {
+                float p = ctx->model->frequency(i) / frequency_sum;
+                noise_max = std::min(noise_max, std::abs(p * log(p)) / 2);
             }
+
+            noise_vec = std::vector<float>(wave_size);
+            for (unsigned i = 0; i < wave_size; i++) {
+                noise_vec[i] = unit::getRand(ctx->random, 0, noise_max);
+            }
+        }
+
+        //只有一个图案时 所有wave一开始就是确定的  否则所有wave按(带噪声的)熵入堆
+        entropy_heap.init(wave_size);
+        if (ctx->model->feature_size() > 1) {
+            for (unsigned i = 0; i < wave_size; i++) {
+                entropy_heap.update(i, get_entropy(i));
+            }
+        }
+    }
+
+    void init_map() {
+        const unsigned fea_size = ctx->model->feature_size();
+        const unsigned words = (fea_size + 63) / 64;
+        const unsigned line_words = 64 / sizeof(uint64_t);
+        row_words = words < line_words ? words : (words + line_words - 1) / line_words * line_words;
+
+        //先生成一行 前 fea_size 位为1 其余补齐位为0  再整行复制到每个wave
+        std::vector<uint64_t> row(row_words, 0);
+        for (unsigned i = 0; i < fea_size / 64; i++) {
+            row[i] = ~uint64_t(0);
+        }
+        if (fea_size % 64) {
+            row[fea_size / 64] = (uint64_t(1) << (fea_size % 64)) - 1;
+        }
+
+        wave_bits.resize((size_t) wave_size * row_words);
+        for (unsigned i = 0; i < wave_size; i++) {
+            std::copy(row.begin(), row.end(), wave_bits.data() + (size_t) i * row_words);
         }
     }
 
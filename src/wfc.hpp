@@ -4,56 +4,313 @@
 #include <limits>
 #include <unordered_map>
 #include <stack>
+#include <deque>
+#include <atomic>
 
 #include "wave.hpp"
+#include "parallelPropagation.hpp"
 //#include "svg.hpp"
 
+// 一次 run() 的结果
+struct RunResult {
+    bool success;
+    uint64_t seed;              // 最后一次尝试使用的种子
+    unsigned attempts;          // 尝试的次数
+    unsigned contradictions;    // 所有尝试中遇到的矛盾次数
+    unsigned backtracks;        // 所有尝试中回溯的次数
+    bool cancelled;             // 因为取消而提前结束  成功的生成总是false
+};
+
 class WFC {
 public:
-    void run() noexcept {
-        init_input_data();
+    // model 为空时 第一次 run() 会从输入构建规则集
+    explicit WFC(const Config &conf, std::shared_ptr<const Model> model = nullptr)
+            : ctx(conf, std::move(model)), data(&ctx), wave(&ctx), counting(&ctx) {}
+
+    WFC(const WFC &) = delete;
+
+    WFC &operator=(const WFC &) = delete;
+
+    virtual ~WFC() = default;
+
+    // 从输入中编译规则集  结果可以交给其它 WFC 重复使用
+    std::shared_ptr<Model> build_model() {
+        std::shared_ptr<Model> model = std::make_shared<Model>(ctx.conf);
+        init_input_data(*model);
+        model->compile();
+        return model;
+    }
+
+    const std::shared_ptr<const Model> &get_model() const noexcept {
+        return ctx.model;
+    }
+
+    // 失败时用派生的种子重新生成 最多 max_attempts 次  规则集只构建一次 每次只重置wave和计数
+    bool run() noexcept {
+        if (!ctx.model) {
+            ctx.model = build_model();
+        }
+        const uint64_t base_seed = ctx.conf.seed ? ctx.conf.seed : unit::random_seed();
+        contradictions = 0;
+        backtracks = 0;
+        cancelled = false;
+        for (attempts = 1; attempts <= ctx.conf.max_attempts; attempts++) {
+            seed = unit::derive_seed(base_seed, attempts - 1);
+            succeeded = run_once(seed);
+            if (succeeded) {
+                write_output();
+                show_stats();
+                return true;
+            }
+            // 被取消时不再重试 也不写出结果  最后一次尝试自己失败时仍按失败处理
+            if (is_cancelled() && attempts < ctx.conf.max_attempts) cancelled = true;
+            if (cancelled) return false;
+            if (ctx.conf.log) {
+                std::cout << "attempt " << attempts << " failed  seed " << seed << std::endl;
+            }
+        }
+        attempts = ctx.conf.max_attempts;
+        write_output();
+        std::cout << "failure!!!!!!!!!!!!!!" << std::endl;
+        show_stats();
+        return false;
+    }
+
+    // 生成开始前先把这些wave固定为给定的图案  (wave_id, fea_id)  用于分块生成时接上已经完成的邻居
+    void set_pins(std::vector<std::pair<unsigned, unsigned>> pins) {
+        this->pins = std::move(pins);
+    }
+
+    // cancel 变为true后 正在进行的生成在下一次观察前结束 run() 返回false
+    // cancel 由调用者持有 必须比本次 run() 活得更久
+    void set_cancel(const std::atomic<bool> *cancel) noexcept {
+        this->cancel = cancel;
+    }
+
+    bool is_cancelled() const noexcept {
+        return cancel && cancel->load(std::memory_order_relaxed);
+    }
+
+    // 每个wave最终的图案  wave_height * wave_width
+    Matrix<unsigned> get_output() noexcept {
+        return wave_to_output();
+    }
+
+    // 开始一次尝试 直到第一次观察之前: 重置wave和计数 删掉没有支持的图案 接上固定的wave并传播
+    // 出现矛盾时返回false  之后可以用 possible() 查看传播后的wave
+    bool prepare(uint64_t seed) noexcept {
+        if (!ctx.model) {
+            ctx.model = build_model();
+        }
+        ctx.random.seed(seed);
         wave.init_wave();
+        // 上一次尝试在传播前失败时 可能留下没有传播的删除
+        std::stack<std::tuple<unsigned, unsigned>>().swap(ctx.propagating);
+        if (use_mask_propagation()) {
+            // 位掩码传播不使用兼容计数
+            ctx.model->compile_dense();
+            init_mask_propagation();
+        } else {
+            data.init_compatible_count();
+            counting.init(wave, ctx.conf.propagation_threads);
+        }
+        // 第一次观察之前的删除不会被撤销  不记日志
+        wave.set_journaling(false);
+        data.set_journaling(false);
+        decisions.clear();
+        if (!apply_pins()) return false;
+        // 回溯次数已经用完时不再需要日志  计数表超过32位索引的范围时不能回溯
+        journaling = ctx.conf.backtrack > backtracks && data.can_journal();
+        wave.set_journaling(journaling);
+        data.set_journaling(journaling);
+        return true;
+    }
+
+    // fea_id 是否仍然可能出现在 wave_id 上
+    bool possible(unsigned wave_id, unsigned fea_id) const noexcept {
+        return wave.get(wave_id, fea_id);
+    }
+
+    // 本次运行的统计  seed 为最后一次尝试的种子 成功时用它可以复现结果
+    RunResult get_result() const noexcept {
+        return RunResult{succeeded, seed, attempts, contradictions, backtracks, cancelled};
+    }
+
+    // 本次运行中遇到的矛盾次数
+    unsigned get_contradictions() const noexcept {
+        return contradictions;
+    }
+
+    // 本次运行中撤销的选择次数
+    unsigned get_backtracks() const noexcept {
+        return backtracks;
+    }
+
+protected:
+    // 本次生成的全部数据  必须在 data 和 wave 之前构造
+    Context ctx;
+
+public:
+    Data<int, AbstractFeature> data;
+
+private:
+    Wave wave;
+
+    // 计数传播 (ac4)  propagation_threads 只影响速度 不影响结果
+    ParallelPropagation counting;
+
+    unsigned contradictions = 0;
+
+    unsigned backtracks = 0;
+
+    unsigned attempts = 0;
+
+    uint64_t seed = 0;
+
+    bool succeeded = false;
+
+    bool cancelled = false;
+
+    std::vector<std::pair<unsigned, unsigned>> pins;
+
+    const std::atomic<bool> *cancel = nullptr;
+
+    // 没有输出路径时(例如分块生成的一块) 结果由调用者通过 get_output() 取走
+    void write_output() {
+        if (!ctx.conf.output_data.empty()) {
+            this->show_result(wave_to_output());
+        }
+    }
+
+    // 某个方向上没有任何兼容图案的图案  只要该方向上有邻居 它就不可能出现
+    // 它的兼容计数从0开始 不会再被减到0  两种传播都不会删除它 所以在生成开始前一次删掉
+    void ban_unsupported() {
+        const unsigned direction_size = ctx.model->_direction.getMaxNumber();
+        std::vector<std::vector<unsigned>> unsupported(direction_size);
+        for (unsigned directionId = 0; directionId < direction_size; directionId++) {
+            for (unsigned fea_id = 0; fea_id < ctx.model->feature_size(); fea_id++) {
+                if (ctx.model->compatible_size(fea_id, directionId) == 0) unsupported[directionId].push_back(fea_id);
+            }
+        }
+        for (unsigned wave_id = 0; wave_id < ctx.conf.wave_size; wave_id++) {
+            const unsigned x = wave_id % ctx.conf.wave_width;
+            const unsigned y = wave_id / ctx.conf.wave_width;
+            for (unsigned directionId = 0; directionId < direction_size; directionId++) {
+                unsigned wave_next;
+                if (unsupported[directionId].empty() || !get_neighbor(x, y, directionId, wave_next)) continue;
+                for (unsigned fea_id : unsupported[directionId]) {
+                    if (wave.get(wave_id, fea_id)) ban(wave_id, fea_id);
+                }
+            }
+        }
+    }
+
+    // 删掉没有支持的图案 固定的wave一次性确定后统一传播  固定的图案互相矛盾时本次尝试失败
+    bool apply_pins() noexcept {
+        ban_unsupported();
+        if (wave.is_contradiction()) return false;
+        for (const std::pair<unsigned, unsigned> &pin : pins) {
+            if (!wave.get(pin.first, pin.second)) return false;
+            wave.collapse(pin.first, pin.second);
+        }
+        this->propagate();
+        return !wave.is_contradiction();
+    }
+
+    // 用给定的种子完整地生成一次  成功返回true
+    bool run_once(uint64_t seed) noexcept {
+        if (!prepare(seed)) {
+            contradictions++;
+            return false;
+        }
         while (true) {
+            if (is_cancelled()) {
+                cancelled = true;
+                return false;
+            }
+
             // 定义未定义的网格值  只是观察 返回的是状态
             ObserveStatus result = observe();
-            // 检查算法是否结束
-            if (result == success) {
-                this->show_result(wave_to_output());
-                return;
-            }
 
+            // 回溯模式下 撤销最近的选择后继续
             if (result == failure) {
-                this->show_result(wave_to_output());
-                std::cout << "failure!!!!!!!!!!!!!!" << std::endl;
-                break;
+                contradictions++;
+                if (backtrack()) continue;
+                return false;
+            }
+            // 检查算法是否结束
+            if (result == success) {
+                return true;
             }
             // 传递信息
             this->propagate();
         }
     }
 
-    Data<int, AbstractFeature> data;
+    // 一次观察所做的选择  以及选择之前两份日志的长度
+    struct Decision {
+        unsigned wave_id;
+        unsigned fea_id;
+        size_t wave_journal;
+        size_t count_journal;
+    };
 
-private:
-    Wave wave;
+    // 只保留还可能被撤销的选择  不超过剩余的回溯次数
+    std::deque<Decision> decisions;
+
+    bool journaling = false;
+
+    void show_stats() const {
+        if (ctx.conf.log) {
+            std::cout << "contradictions  " << contradictions << "  backtracks  " << backtracks << "  attempts  "
+                      << attempts << "  seed  " << seed << std::endl;
+        }
+    }
+
+    // 撤销最近的选择 并把选中的图案从该wave中排除  排除后仍然矛盾就继续往前撤销
+    // 回溯次数用完或已经没有可撤销的选择时返回false
+    bool backtrack() noexcept {
+        while (!decisions.empty() && backtracks < ctx.conf.backtrack) {
+            backtracks++;
+            Decision decision = decisions.back();
+            decisions.pop_back();
+
+            std::stack<std::tuple<unsigned, unsigned>>().swap(ctx.propagating);
+            wave.rollback(decision.wave_journal);
+            data.rollback(decision.count_journal);
+
+            ban(decision.wave_id, decision.fea_id);
+            this->propagate();
+            if (!wave.is_contradiction()) return true;
+            contradictions++;
+        }
+        return false;
+    }
+
+    // 丢掉最早保留的选择之前的日志  没有保留的选择时全部丢掉
+    void discard_journal() {
+        if (decisions.empty()) {
+            wave.discard_journal(wave.journal_size());
+            data.discard_journal(data.journal_size());
+        } else {
+            wave.discard_journal(decisions.front().wave_journal);
+            data.discard_journal(decisions.front().count_journal);
+        }
+    }
 
     Matrix<unsigned> wave_to_output() noexcept {
-        Matrix<unsigned> output_features(conf->wave_height, conf->wave_width);
-        for (unsigned i = 0; i < conf->wave_size; i++) {
-            for (unsigned k = 0; k < feature.size(); k++) {
-                if (wave.get(i, k)) {
-                    output_features.get(i) = k;
-                }
+        Matrix<unsigned> output_features(ctx.conf.wave_height, ctx.conf.wave_width);
+        for (unsigned i = 0; i < ctx.conf.wave_size; i++) {
+            unsigned k = wave.next_feature(i, 0);
+            if (k < ctx.model->feature_size()) {
+                output_features.get(i) = k;
             }
         }
         return output_features;
     }
 
     void ban(unsigned wave_id, unsigned fea_id) {
-        for (unsigned i = 0; i < _direction.getMaxNumber(); i++) {
-            compatible_feature_map[data.getKey(wave_id, fea_id, i)] = 0;
-        }
-        propagating.push(std::tuple<unsigned int, unsigned int>(wave_id, fea_id));
+        ctx.propagating.push(std::tuple<unsigned int, unsigned int>(wave_id, fea_id));
 
         wave.ban(wave_id, fea_id, false);
 //        std::cout << " wave_min_id " << wave_id << " fea_id " << fea_id << "   " << feature.size() << std::endl;
@@ -61,89 +318,191 @@ private:
 
 
     ObserveStatus observe() noexcept {
-        // 得到具有最低熵的wave_id
-        int wave_min_id = success;
-        float min = std::numeric_limits<float>::infinity();// float的最大值
-        for (unsigned wave_id = 0; wave_id < conf->wave_size; wave_id++) {
-            int amount = wave.get_wave_frequency(wave_id);
-
-            float entropy = wave.get_entropy(wave_id);
-
-            if (amount > 1 && entropy < min) {
-                min = entropy;
-                wave_min_id = wave_id;
-            }
+        // 有wave没有任何可能的图案 本次生成失败
+        if (wave.is_contradiction()) {
+            return failure;
         }
 
-        if (wave_min_id == success) {
+        // 得到具有最低熵的wave_id  堆为空说明所有wave都已确定
+        if (wave.is_all_decided()) {
             return success;
         }
+        unsigned wave_min_id = wave.get_min_entropy_wave();
 
-        unsigned sum = wave.get_wave_all_frequency(wave_min_id); //得到此wave 在所有feature中出现的次数的总合
-        unsigned chosen_fea_id = wave.get_chosen_value_by_random(wave_min_id, sum);//取wave中的一个fea_id，频率越大，则越有可能被选到
+        unsigned chosen_fea_id = wave.get_chosen_value_by_random(wave_min_id);//取wave中的一个fea_id，频率越大，则越有可能被选到
 
-        for (unsigned fea_id = 0; fea_id < feature.size(); fea_id++) {
-//            如果wave_min_id对应的图案在argmin中 并且不是选择的元素,就ban了
-//            只要不是所选的，都ban了
-            if (wave.get(wave_min_id, fea_id) && fea_id != chosen_fea_id) {
-                ban(wave_min_id, fea_id);
+        // 记录选择  每次回溯撤销一个选择 剩余的回溯次数之外更早的选择不会再被撤销
+        // 最早保留的选择之前的日志可以丢掉  日志的长度只与最近的 backtrack 个选择有关 而不是整张图
+        if (journaling) {
+            decisions.push_back(Decision{wave_min_id, chosen_fea_id, wave.journal_size(), data.journal_size()});
+            const size_t budget = ctx.conf.backtrack - backtracks;
+            while (decisions.size() > budget) {
+                decisions.pop_front();
             }
+            discard_journal();
         }
 
+        // 只保留选中的图案  其余的一次清除并等待传播
+        wave.collapse(wave_min_id, chosen_fea_id);
+
         //观察结束  继续进行计算
         return to_continue;
     }
 
     void propagate() noexcept {
-        //从最后一个传播状态开始传播,每传播成功一次，就移除一次，直到传播列表为空
-        unsigned wave_id, fea_id, wave_next;
-        while (!propagating.empty()) {
-            // The cell and fea_id that has been set to false.
-            std::tie(wave_id, fea_id) = propagating.top();
-            propagating.pop();
-
-            //对图案的各个方向进进行传播
-            for (unsigned directionId = 0; directionId < _direction.getMaxNumber(); directionId++) {
-                //跟具此fea的id 和一个方向id  确定下一个fea的id
-                wave_next = _direction.movePatternByDirection(wave_id, directionId, conf->wave_width);
-
-                //只有有效的feature才传播
-                if (!this->isVaildPatternId(wave_next)) {
-                    continue;
-                }
+        if (use_mask_propagation()) {
+            propagate_mask();
+        } else if (data.is_narrow()) {
+            counting.propagate(wave, data.narrow_count, ctx.model->narrow_propagator);
+        } else {
+            counting.propagate(wave, data.wide_count, ctx.model->wide_propagator);
+        }
+    }
+
+    // (x, y) 在 directionId 方向上的相邻wave  超出输出范围时返回false
+    // 按坐标判断 行首的左边不会绕到上一行的行尾
+    bool get_neighbor(unsigned x, unsigned y, unsigned directionId, unsigned &wave_next) const noexcept {
+        const std::pair<int, int> &direction = ctx.model->_direction.getDirect(directionId);
+        const int next_x = (int) x + direction.first;
+        const int next_y = (int) y + direction.second;
+        if (next_x < 0 || next_x >= (int) ctx.conf.wave_width || next_y < 0 || next_y >= (int) ctx.conf.wave_height) {
+            return false;
+        }
+        wave_next = next_y * ctx.conf.wave_width + next_x;
+        return true;
+    }
 
-                const auto &temp = propagator[fea_id][directionId];
-                for (unsigned fea_id_2 = 0; fea_id_2 < temp.size(); fea_id_2++) {
-                    if (!temp.get(fea_id_2)) continue;
+    bool use_mask_propagation() const noexcept {
+        return ctx.conf.propagation == Propagation::ac3;
+    }
+
+    // 位掩码传播 (按位并行的 AC-3)
+    // 队列中放的是wave而不是单个图案  每个wave累积一个自上次处理以来被删除图案的掩码
+    // 处理一个wave时 按方向一次算出邻居中失去所有支持的图案 整个掩码一起删除
+    std::vector<unsigned> mask_queue;
+    std::vector<char> in_mask_queue;
+    unit::AlignedArray<uint64_t> removed_bits;  // 每个wave待传播的删除掩码  与wave的位行布局相同
+    std::vector<uint64_t> candidate;           // 邻居中可能失去支持的图案
+
+    void init_mask_propagation() {
+        mask_queue.clear();
+        in_mask_queue.assign(ctx.conf.wave_size, 0);
+        removed_bits.resize((size_t) ctx.conf.wave_size * wave.row_word_size());
+        candidate.assign(ctx.model->word_size(), 0);
+    }
 
-                    int &directionCount = data.getDirectionCount(wave_next, fea_id_2, directionId);
-                    directionCount--;
-                    if (directionCount == 0) {
-                        ban(wave_next, fea_id_2);
+    void mark_removed(unsigned wave_id, const uint64_t *mask, unsigned words) noexcept {
+        uint64_t *removed = removed_bits.data() + (size_t) wave_id * wave.row_word_size();
+        for (unsigned w = 0; w < words; w++) removed[w] |= mask[w];
+        if (!in_mask_queue[wave_id]) {
+            in_mask_queue[wave_id] = 1;
+            mask_queue.push_back(wave_id);
+        }
+    }
+
+    void clear_mask_queue() noexcept {
+        const unsigned row_words = wave.row_word_size();
+        for (unsigned wave_id : mask_queue) {
+            in_mask_queue[wave_id] = 0;
+            std::fill(removed_bits.data() + (size_t) wave_id * row_words,
+                      removed_bits.data() + (size_t) (wave_id + 1) * row_words, 0);
+        }
+        mask_queue.clear();
+    }
+
+    void propagate_mask() noexcept {
+        const unsigned words = ctx.model->word_size();
+        const unsigned row_words = wave.row_word_size();
+        const unsigned direction_size = ctx.model->_direction.getMaxNumber();
+
+        // 观察和回溯产生的逐个删除先合并进各个wave的掩码
+        unsigned wave_id, fea_id;
+        while (!ctx.propagating.empty()) {
+            std::tie(wave_id, fea_id) = ctx.propagating.top();
+            ctx.propagating.pop();
+            removed_bits[(size_t) wave_id * row_words + (fea_id >> 6)] |= uint64_t(1) << (fea_id & 63);
+            if (!in_mask_queue[wave_id]) {
+                in_mask_queue[wave_id] = 1;
+                mask_queue.push_back(wave_id);
+            }
+        }
+
+        // 按入队顺序处理  处理过程中新入队的wave追加到末尾
+        for (size_t head = 0; head < mask_queue.size(); head++) {
+            wave_id = mask_queue[head];
+            in_mask_queue[wave_id] = 0;
+            uint64_t *removed = removed_bits.data() + (size_t) wave_id * row_words;
+            const uint64_t *row = wave.row(wave_id);
+            const unsigned removed_size = bits::popcount(removed, words);
+            const unsigned remain_size = bits::popcount(row, words);
+            const unsigned x = wave_id % ctx.conf.wave_width;
+            const unsigned y = wave_id / ctx.conf.wave_width;
+
+            for (unsigned directionId = 0; directionId < direction_size; directionId++) {
+                unsigned wave_next;
+                if (!get_neighbor(x, y, directionId, wave_next)) continue;
+                const uint64_t *next_row = wave.row(wave_next);
+                const unsigned opposite = ctx.model->_direction.get_opposite_direction(0, directionId);
+
+                if (removed_size < remain_size) {
+                    // 删除的少: 只有与被删除图案兼容的邻居图案可能失去支持  逐个检查它们在反方向上是否还有支持
+                    std::fill(candidate.begin(), candidate.end(), 0);
+                    for (unsigned w = 0; w < words; w++) {
+                        for (uint64_t word = removed[w]; word; word &= word - 1) {
+                            ctx.model->or_compatible(candidate.data(), (w << 6) + bits::lowest(word), directionId);
+                        }
+                    }
+                    for (unsigned w = 0; w < words; w++) {
+                        uint64_t lost = 0;
+                        for (uint64_t word = candidate[w] & next_row[w]; word; word &= word - 1) {
+                            const unsigned bit = bits::lowest(word);
+                            if (!ctx.model->any_compatible(row, (w << 6) + bit, opposite)) {
+                                lost |= uint64_t(1) << bit;
+                            }
+                        }
+                        candidate[w] = lost;
+                    }
+                } else {
+                    // 剩下的少: 邻居可以保留的图案 = 剩余图案在此方向上兼容图案的并集
+                    std::fill(candidate.begin(), candidate.end(), 0);
+                    for (unsigned w = 0; w < words; w++) {
+                        for (uint64_t word = row[w]; word; word &= word - 1) {
+                            ctx.model->or_compatible(candidate.data(), (w << 6) + bits::lowest(word), directionId);
+                        }
                     }
+                    for (unsigned w = 0; w < words; w++) candidate[w] = next_row[w] & ~candidate[w];
                 }
+
+                if (wave.remove(wave_next, candidate.data()) == 0) continue;
+                if (wave.is_contradiction()) {
+                    std::fill(removed, removed + row_words, 0);
+                    mask_queue.erase(mask_queue.begin(), mask_queue.begin() + head + 1);
+                    clear_mask_queue();
+                    return;
+                }
+                mark_removed(wave_next, candidate.data(), words);
             }
+            std::fill(removed, removed + row_words, 0);
         }
+        mask_queue.clear();
     }
 
-    virtual void init_direction() = 0;
+    virtual void init_direction(Model &model) = 0;
 
     virtual void init_row_data() = 0;
 
-    virtual void init_features() = 0;
+    virtual void init_features(Model &model) = 0;
 
-    virtual void init_compatible() = 0;
+    virtual void init_compatible(Model &model) = 0;
 
-    virtual void init_input_data() {
-        init_direction();
+    virtual void init_input_data(Model &model) {
+        init_direction(model);
         init_row_data();
-        init_features();
-        init_compatible();
+        init_features(model);
+        init_compatible(model);
     }
 
 
-    virtual bool isVaildPatternId(unsigned pId) = 0;
-
     virtual void show_result(const Matrix<unsigned>& mat) = 0;
 };
 